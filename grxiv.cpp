@@ -5,313 +5,7000 @@
 #include <QOpenGLFunctions>
 #include <QOpenGLShaderProgram>
 #include <QOpenGLTexture>
+#include <QOpenGLBuffer>
+#include <QOpenGLVertexArrayObject>
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLContext>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLPixelTransferOptions>
+#include <QOffscreenSurface>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTextStream>
+#include <QPainter>
+#include <QFontDatabase>
+#ifndef QT_OPENGL_ES_2
+#include <QOpenGLTimerQuery>
+#endif
 #include <QWheelEvent>
 #include <QCommandLineParser>
 #include <QSurfaceFormat>
 #include <QKeyEvent>
+#include <QMouseEvent>
+#include <QScreen>
+#include <QWindow>
+#include <QPointer>
 #include <QDir>
 #include <QFileInfoList>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QVector>
+#include <QVector2D>
 #include <QBuffer>
 #include <QImageReader>
+#include <QImageWriter>
 #include <QFile>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThread>
+#include <QAtomicInt>
+#include <QSharedPointer>
+#include <QHash>
+#include <QSet>
+#include <QCache>
+#include <QDateTime>
+#include <QTimer>
+#include <QEventLoop>
+#include <QXmlStreamReader>
+#include <QXmlStreamWriter>
+#include <QStandardPaths>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <functional>
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <cmath>
+#include <cctype>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define GRXIV_X86_KERNELS
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define GRXIV_NEON_KERNELS
+#endif
+
+#ifdef GRXIV_TURBOJPEG
+#include <turbojpeg.h>
+#endif
+
+#ifdef GRXIV_LIBJPEG
+#include <csetjmp>
+#include <cstdio>
+#include <jpeglib.h>
+#endif
+
+#ifdef GRXIV_LIBPNG
+#include <png.h>
+#endif
+
+#ifdef GRXIV_LIBTIFF
+#include <tiffio.h>
+#endif
+
+#ifndef GL_UNPACK_ROW_LENGTH
+#define GL_UNPACK_ROW_LENGTH 0x0CF2
+#endif
+
+struct ViewerOptions {
+    int prefetchRadius;
+    qint64 ramCacheBytes;
+    qint64 vramCacheBytes;
+    bool reducedDecode;
+    bool compressTextures;
+    QString thumbnailStorePath;
+    // BC1/BC3 textures, in a pack of their own so they cannot crowd out
+    // the thumbnails.
+    QString compressedStorePath;
+    int readaheadCount;
+    int ioDepth;
+    bool watchMemoryPressure;
+
+    ViewerOptions()
+        : prefetchRadius(1), ramCacheBytes(Q_INT64_C(1) << 30), vramCacheBytes(Q_INT64_C(512) << 20), reducedDecode(true), compressTextures(false),
+          readaheadCount(8), ioDepth(4), watchMemoryPressure(true) {}
+};
+
+static qint64 parseByteSize(const QString& text, bool* ok) {
+    QString value = text.trimmed().toUpper();
+    if (value.endsWith('B')) {
+        value.chop(1);
+    }
+    qint64 multiplier = 1;
+    if (value.endsWith('K')) {
+        multiplier = Q_INT64_C(1) << 10;
+    } else if (value.endsWith('M')) {
+        multiplier = Q_INT64_C(1) << 20;
+    } else if (value.endsWith('G')) {
+        multiplier = Q_INT64_C(1) << 30;
+    }
+    if (multiplier != 1) {
+        value.chop(1);
+    }
+    double number = value.toDouble(ok);
+    if (!*ok || number < 0) {
+        *ok = false;
+        return 0;
+    }
+    return static_cast<qint64>(number * multiplier);
+}
+
+// Parses WIDTHxHEIGHT, e.g. 1920x1080; an invalid size on failure.
+static QSize parseBoxSize(const QString& text) {
+    QStringList parts = text.trimmed().toLower().split('x');
+    if (parts.size() != 2) {
+        return QSize();
+    }
+    bool widthOk = false;
+    bool heightOk = false;
+    QSize size(parts[0].toInt(&widthOk), parts[1].toInt(&heightOk));
+    return widthOk && heightOk && size.width() > 0 && size.height() > 0 ? size : QSize();
+}
+
+static double elapsedMilliseconds(const QElapsedTimer& timer) {
+    return timer.nsecsElapsed() / 1000000.0;
+}
+
+static QString cacheKey(const QString& path, qint64 modified) {
+    return path + '@' + QString::number(modified);
+}
+
+struct ImageEntry {
+    QString name;
+    qint64 modified;
+    qint64 size;
+
+    bool operator<(const ImageEntry& other) const {
+        return name < other.name;
+    }
+};
+
+static QStringList imageNameFilters() {
+    QStringList filters;
+    filters << "*.jpg" << "*.jpeg" << "*.png" << "*.bmp" << "*.gif" << "*.webp";
+    return filters;
+}
+
+// The file itself, or the sorted images directly inside a directory.
+static QStringList imagePathsIn(const QString& path) {
+    QStringList paths;
+    QFileInfo target(path);
+    if (target.isDir()) {
+        QDirIterator it(target.absoluteFilePath(), imageNameFilters(), QDir::Files | QDir::NoDotAndDotDot);
+        while (it.hasNext()) {
+            paths << it.next();
+        }
+        paths.sort();
+    } else if (target.isFile()) {
+        paths << target.absoluteFilePath();
+    }
+    return paths;
+}
+
+class DirectoryScanJob : public QRunnable {
+public:
+    typedef std::function<void(const QVector<ImageEntry>&, bool)> Callback;
+
+    DirectoryScanJob(const QString& directory, const QSharedPointer<QAtomicInt>& cancelled, QObject* receiver, const Callback& callback)
+        : directory(directory), cancelled(cancelled), receiver(receiver), callback(callback) {}
+
+    void run() override {
+        QDirIterator it(directory, imageNameFilters() << "*.dzi", QDir::Files | QDir::NoDotAndDotDot);
+        QVector<ImageEntry> batch;
+        QElapsedTimer sinceFlush;
+        sinceFlush.start();
+        bool first = true;
+        while (it.hasNext() && !cancelled->loadAcquire()) {
+            it.next();
+            ImageEntry entry;
+            entry.name = it.fileName();
+            entry.modified = it.fileInfo().lastModified().toMSecsSinceEpoch();
+            entry.size = it.fileInfo().size();
+            batch.append(entry);
+            if (first || batch.size() >= maxBatchSize || sinceFlush.elapsed() >= flushIntervalMs) {
+                post(batch, false);
+                batch.clear();
+                sinceFlush.restart();
+                first = false;
+            }
+        }
+        if (!cancelled->loadAcquire()) {
+            post(batch, true);
+        }
+    }
+
+private:
+    static const int maxBatchSize = 4096;
+    static const int flushIntervalMs = 100;
+
+    void post(const QVector<ImageEntry>& batch, bool finished) {
+        QSharedPointer<QAtomicInt> token = cancelled;
+        Callback done = callback;
+        QMetaObject::invokeMethod(receiver, [batch, finished, token, done]() {
+            if (!token->loadAcquire()) {
+                done(batch, finished);
+            }
+        }, Qt::QueuedConnection);
+    }
+
+    QString directory;
+    QSharedPointer<QAtomicInt> cancelled;
+    QObject* receiver;
+    Callback callback;
+};
+
+// Longest prefix of a file pulled into the page cache ahead of its decode.
+static const qint64 readaheadBytesLimit = Q_INT64_C(64) << 20;
+
+// Paths waiting in the readahead pool, and those whose read has started.
+// A path only counts as warmed once its job runs, so jobs dropped from the
+// queue before starting can be asked for again.
+struct ReadaheadPaths {
+    QMutex mutex;
+    QSet<QString> queued;
+    QSet<QString> issued;
+};
+
+// posix_fadvise(WILLNEED) only queues readahead, and readahead(2) returns
+// once the pages are in flight; either can still block for a while on NFS
+// or a busy disk, hence a job of its own. The size comes from the directory
+// scan, so warming a file costs no extra stat.
+class ReadaheadJob : public QRunnable {
+public:
+    ReadaheadJob(const QString& path, qint64 size, ReadaheadPaths* paths) : path(path), size(size), paths(paths) {}
+
+    void run() override {
+        {
+            QMutexLocker locker(&paths->mutex);
+            paths->queued.remove(path);
+            paths->issued.insert(path);
+        }
+        int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        qint64 length = size > 0 ? qMin(size, readaheadBytesLimit) : readaheadBytesLimit;
+        posix_fadvise(fd, 0, static_cast<off_t>(length), POSIX_FADV_WILLNEED);
+#ifdef __linux__
+        readahead(fd, 0, static_cast<size_t>(length));
+#endif
+        ::close(fd);
+    }
+
+private:
+    QString path;
+    qint64 size;
+    ReadaheadPaths* paths;
+};
+
+// Warms the page cache for the files the viewer is about to open, so that on
+// network or spinning storage a key press waits for decoding rather than
+// for seeks. At most depth reads are outstanding; a new request replaces
+// whatever is still queued.
+class FileReadahead {
+public:
+    explicit FileReadahead(int depth) {
+        pool.setMaxThreadCount(qMax(1, depth));
+    }
+
+    ~FileReadahead() {
+        pool.clear();
+        pool.waitForDone();
+    }
+
+    void clearQueue() {
+        pool.clear();
+        QMutexLocker locker(&paths.mutex);
+        paths.queued.clear();
+    }
+
+    void request(const QString& path, qint64 size) {
+        QMutexLocker locker(&paths.mutex);
+        if (paths.issued.contains(path) || paths.queued.contains(path)) {
+            return;
+        }
+        if (paths.issued.size() >= issuedLimit) {
+            paths.issued.clear();
+        }
+        paths.queued.insert(path);
+        pool.start(new ReadaheadJob(path, size, &paths));
+    }
+
+private:
+    static const int issuedLimit = 4096;
+
+    // Files already warmed are not asked for again until the set is reset.
+    ReadaheadPaths paths;
+    QThreadPool pool;
+};
+
+class DirectoryScanner {
+public:
+    DirectoryScanner(QObject* receiver, const DirectoryScanJob::Callback& callback)
+        : cancelled(new QAtomicInt(0)), receiver(receiver), callback(callback) {
+        pool.setMaxThreadCount(1);
+    }
+
+    ~DirectoryScanner() {
+        cancel();
+    }
+
+    void start(const QString& directory) {
+        cancel();
+        cancelled = QSharedPointer<QAtomicInt>(new QAtomicInt(0));
+        pool.start(new DirectoryScanJob(directory, cancelled, receiver, callback));
+    }
+
+    void cancel() {
+        cancelled->storeRelease(1);
+        pool.waitForDone();
+    }
+
+private:
+    QThreadPool pool;
+    QSharedPointer<QAtomicInt> cancelled;
+    QObject* receiver;
+    DirectoryScanJob::Callback callback;
+};
+
+class TextureCache {
+public:
+    typedef std::function<void(QOpenGLTexture*)> EvictionHandler;
+
+    typedef std::function<qint64()> ReservedBytes;
+
+    TextureCache(qint64 maxBytes, const EvictionHandler& evicted)
+        : maxBytes(maxBytes), totalBytes(0), evicted(evicted) {}
+
+    // Bytes of maxBytes spent outside the cache, when it shares a budget.
+    void setReserved(const ReservedBytes& bytes) {
+        reserved = bytes;
+    }
+
+    ~TextureCache() {
+        clear();
+    }
+
+    bool contains(const QString& key) const {
+        return entries.contains(key);
+    }
+
+    qint64 bytes() const {
+        return totalBytes;
+    }
+
+    QOpenGLTexture* object(const QString& key) {
+        QHash<QString, Entry>::iterator it = entries.find(key);
+        if (it == entries.end()) {
+            return nullptr;
+        }
+        order.removeOne(key);
+        order.prepend(key);
+        return it->texture;
+    }
+
+    bool insert(const QString& key, QOpenGLTexture* texture, qint64 bytes) {
+        qint64 limit = availableBytes();
+        if (bytes > limit || entries.contains(key)) {
+            return false;
+        }
+        while (totalBytes + bytes > limit) {
+            QString victim = leastRecentUnpinned();
+            if (victim.isNull()) {
+                return false;
+            }
+            evicted(remove(victim));
+        }
+        Entry entry;
+        entry.texture = texture;
+        entry.bytes = bytes;
+        entries.insert(key, entry);
+        order.prepend(key);
+        totalBytes += bytes;
+        return true;
+    }
+
+    QOpenGLTexture* take(const QString& key) {
+        return entries.contains(key) ? remove(key) : nullptr;
+    }
+
+    // Least recently used first.
+    QList<QString> keys() const {
+        QList<QString> oldestFirst;
+        for (int i = order.size() - 1; i >= 0; --i) {
+            oldestFirst.append(order[i]);
+        }
+        return oldestFirst;
+    }
+
+    bool isPinned(const QString& key) const {
+        return pins.contains(key);
+    }
+
+    void setMaxBytes(qint64 bytes) {
+        maxBytes = bytes;
+        while (totalBytes > availableBytes()) {
+            QString victim = leastRecentUnpinned();
+            if (victim.isNull()) {
+                return;
+            }
+            evicted(remove(victim));
+        }
+    }
+
+    // A key is pinned while some window shows its texture; pinned entries
+    // are skipped by eviction.
+    void pin(const QString& key) {
+        ++pins[key];
+    }
+
+    void unpin(const QString& key) {
+        if (--pins[key] <= 0) {
+            pins.remove(key);
+        }
+    }
+
+    void clear() {
+        while (!order.isEmpty()) {
+            delete remove(order.last());
+        }
+    }
+
+private:
+    struct Entry {
+        QOpenGLTexture* texture;
+        qint64 bytes;
+    };
+
+    QString leastRecentUnpinned() const {
+        for (int i = order.size() - 1; i >= 0; --i) {
+            if (!pins.contains(order[i])) {
+                return order[i];
+            }
+        }
+        return QString();
+    }
+
+    QOpenGLTexture* remove(const QString& key) {
+        Entry entry = entries.take(key);
+        order.removeOne(key);
+        totalBytes -= entry.bytes;
+        return entry.texture;
+    }
+
+    qint64 availableBytes() const {
+        return maxBytes - (reserved ? reserved() : 0);
+    }
+
+    qint64 maxBytes;
+    qint64 totalBytes;
+    EvictionHandler evicted;
+    ReservedBytes reserved;
+    QHash<QString, int> pins;
+    QHash<QString, Entry> entries;
+    QList<QString> order;
+};
+
+static quint32 readInteger(const uchar* data, bool bigEndian, int bytes) {
+    quint32 value = 0;
+    for (int i = 0; i < bytes; ++i) {
+        int shift = bigEndian ? 8 * (bytes - 1 - i) : 8 * i;
+        value |= static_cast<quint32>(data[i]) << shift;
+    }
+    return value;
+}
+
+static void appendInteger(QByteArray* out, quint32 value) {
+    for (int i = 0; i < 4; ++i) {
+        out->append(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+}
+
+class FunctionJob : public QRunnable {
+public:
+    explicit FunctionJob(const std::function<void()>& function) : function(function) {}
+
+    void run() override {
+        function();
+    }
+
+private:
+    std::function<void()> function;
+};
+
+// One read-only mapping of a thumbnail pack and its index. Each write
+// produces a new one, so lookups never see a file being changed.
+struct ThumbnailPack {
+    struct Range {
+        qint64 offset;
+        int length;
+    };
+
+    uchar* data;
+    qint64 size;
+    // End of the last complete record.
+    qint64 validSize;
+    QHash<QString, Range> index;
+
+    ThumbnailPack() : data(nullptr), size(0), validSize(0) {}
+
+    ~ThumbnailPack() {
+        if (data) {
+            munmap(data, size);
+        }
+    }
+
+    QByteArray find(const QString& key) const {
+        QHash<QString, Range>::const_iterator it = index.find(key);
+        if (it == index.end()) {
+            return QByteArray();
+        }
+        return QByteArray(reinterpret_cast<const char*>(data) + it->offset, it->length);
+    }
+};
+
+static QSharedPointer<ThumbnailPack> mapThumbnailPack(int fd) {
+    QSharedPointer<ThumbnailPack> pack(new ThumbnailPack());
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0 || status.st_size <= 0) {
+        return pack;
+    }
+    void* data = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        return pack;
+    }
+    pack->data = static_cast<uchar*>(data);
+    pack->size = status.st_size;
+    qint64 offset = 0;
+    while (offset + 8 <= pack->size) {
+        quint32 keyLength = readInteger(pack->data + offset, false, 4);
+        quint32 dataLength = readInteger(pack->data + offset + 4, false, 4);
+        qint64 end = offset + 8 + keyLength + dataLength;
+        if (keyLength == 0 || dataLength == 0 || end > pack->size || dataLength > INT_MAX) {
+            break;
+        }
+        QString key = QString::fromUtf8(reinterpret_cast<const char*>(pack->data + offset + 8), static_cast<int>(keyLength));
+        ThumbnailPack::Range range;
+        range.offset = offset + 8 + keyLength;
+        range.length = static_cast<int>(dataLength);
+        pack->index.insert(key, range);
+        offset = end;
+    }
+    pack->validSize = offset;
+    return pack;
+}
+
+static QSharedPointer<ThumbnailPack> readThumbnailPack(const QString& path) {
+    int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC);
+    QSharedPointer<ThumbnailPack> pack = mapThumbnailPack(fd);
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    return pack;
+}
+
+static void appendThumbnailRecord(QByteArray* out, const QByteArray& key, const char* data, int length) {
+    appendInteger(out, key.size());
+    appendInteger(out, length);
+    out->append(key);
+    out->append(data, length);
+}
+
+static bool writeFully(int fd, const QByteArray& data, qint64 offset) {
+    qint64 written = 0;
+    while (written < data.size()) {
+        ssize_t result = pwrite(fd, data.constData() + written, data.size() - written, offset + written);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return false;
+        }
+        written += result;
+    }
+    return true;
+}
+
+typedef QList<QPair<QString, QByteArray>> ThumbnailRecords;
+
+// Adds records to the pack at path while holding flock() on a sibling lock
+// file, so instances never write over each other: the index is re-read
+// under the lock, records another instance added meanwhile are kept and a
+// torn tail left by a crash is cut. A pack that would grow past maxBytes is
+// rewritten with the most recently written records up to three quarters of
+// it and renamed over the old one, which instances still mapping it keep
+// reading until their next write. Runs on the store's writer thread.
+static QSharedPointer<ThumbnailPack> writeThumbnailPack(const QString& path, const ThumbnailRecords& records, qint64 maxBytes) {
+    QByteArray name = QFile::encodeName(path);
+    int lock = ::open((name + ".lock").constData(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock < 0 || flock(lock, LOCK_EX) != 0) {
+        if (lock >= 0) {
+            ::close(lock);
+        }
+        return readThumbnailPack(path);
+    }
+    int fd = ::open(name.constData(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    QSharedPointer<ThumbnailPack> pack = mapThumbnailPack(fd);
+    QByteArray batch;
+    for (const QPair<QString, QByteArray>& record : records) {
+        if (!pack->index.contains(record.first)) {
+            appendThumbnailRecord(&batch, record.first.toUtf8(), record.second.constData(), record.second.size());
+        }
+    }
+    if (fd >= 0 && !batch.isEmpty()) {
+        if (pack->validSize + batch.size() <= maxBytes) {
+            if (ftruncate(fd, pack->validSize) == 0 && writeFully(fd, batch, pack->validSize)) {
+                ::fdatasync(fd);
+            }
+        } else {
+            QVector<QPair<qint64, QString>> newestFirst;
+            for (QHash<QString, ThumbnailPack::Range>::const_iterator it = pack->index.constBegin(); it != pack->index.constEnd(); ++it) {
+                newestFirst.append(qMakePair(it->offset, it.key()));
+            }
+            std::sort(newestFirst.begin(), newestFirst.end(), std::greater<QPair<qint64, QString>>());
+            qint64 budget = maxBytes / 4 * 3 - batch.size();
+            int kept = 0;
+            for (qint64 keptBytes = 0; kept < newestFirst.size(); ++kept) {
+                const ThumbnailPack::Range& range = pack->index[newestFirst[kept].second];
+                keptBytes += 8 + newestFirst[kept].second.toUtf8().size() + range.length;
+                if (keptBytes > budget) {
+                    break;
+                }
+            }
+            QByteArray rewritten;
+            for (int i = kept - 1; i >= 0; --i) {
+                const ThumbnailPack::Range& range = pack->index[newestFirst[i].second];
+                appendThumbnailRecord(&rewritten, newestFirst[i].second.toUtf8(), reinterpret_cast<const char*>(pack->data) + range.offset, range.length);
+            }
+            rewritten.append(batch);
+            QByteArray temporary = name + ".tmp";
+            int out = ::open(temporary.constData(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            if (out >= 0 && writeFully(out, rewritten, 0) && ::fdatasync(out) == 0 && ::rename(temporary.constData(), name.constData()) == 0) {
+                ::close(fd);
+                fd = out;
+            } else if (out >= 0) {
+                ::close(out);
+                ::unlink(temporary.constData());
+            }
+        }
+        pack = mapThumbnailPack(fd);
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    flock(lock, LOCK_UN);
+    ::close(lock);
+    return pack;
+}
+
+// Thumbnails of every image ever viewed, kept across sessions in a pack
+// file of at most maxBytes. Each record is a little-endian key length and
+// data length followed by the UTF-8 key ("path@mtime@size") and the encoded
+// thumbnail. The pack is mapped and indexed in memory; new thumbnails are
+// buffered and handed in batches to a writer thread, which appends them
+// with one fdatasync() per batch (see writeThumbnailPack()) and returns a
+// fresh mapping. Lookups see buffered and in-flight records too.
+class ThumbnailStore {
+public:
+    ThumbnailStore(const QString& path, qint64 maxBytes)
+        : path(path), maxBytes(maxBytes), pack(new ThumbnailPack()), pendingBytes(0) {
+        if (path.isEmpty()) {
+            return;
+        }
+        QDir().mkpath(QFileInfo(path).absolutePath());
+        pack = readThumbnailPack(path);
+        writer.setMaxThreadCount(1);
+        flushTimer.setSingleShot(true);
+        flushTimer.setInterval(flushIntervalMs);
+        QObject::connect(&flushTimer, &QTimer::timeout, [this]() { flush(); });
+    }
+
+    // The last batch is written before returning.
+    ~ThumbnailStore() {
+        flushTimer.stop();
+        writer.waitForDone();
+        if (!pendingOrder.isEmpty()) {
+            writeThumbnailPack(path, takePending(), maxBytes);
+        }
+    }
+
+    bool isEnabled() const {
+        return !path.isEmpty();
+    }
+
+    bool contains(const QString& key) const {
+        return pack->index.contains(key) || pending.contains(key) || writing.contains(key);
+    }
+
+    QByteArray find(const QString& key) const {
+        if (pack->index.contains(key)) {
+            return pack->find(key);
+        }
+        QHash<QString, QByteArray>::const_iterator it = pending.find(key);
+        if (it != pending.end()) {
+            return *it;
+        }
+        return writing.value(key);
+    }
+
+    void insert(const QString& key, const QByteArray& encoded) {
+        if (!isEnabled() || encoded.isEmpty() || contains(key)) {
+            return;
+        }
+        pending.insert(key, encoded);
+        pendingOrder.append(key);
+        pendingBytes += encoded.size();
+        if (pendingOrder.size() >= maxPendingRecords || pendingBytes >= maxPendingBytes) {
+            flush();
+        } else if (!flushTimer.isActive()) {
+            flushTimer.start();
+        }
+    }
+
+    // One batch is written at a time; records added meanwhile follow when
+    // it completes.
+    void flush() {
+        flushTimer.stop();
+        if (pendingOrder.isEmpty() || !writing.isEmpty()) {
+            return;
+        }
+        writing = pending;
+        ThumbnailRecords records = takePending();
+        QString packPath = path;
+        qint64 limit = maxBytes;
+        QObject* target = &receiver;
+        writer.start(new FunctionJob([this, packPath, records, limit, target]() {
+            QSharedPointer<ThumbnailPack> written = writeThumbnailPack(packPath, records, limit);
+            QMetaObject::invokeMethod(target, [this, written]() { batchWritten(written); }, Qt::QueuedConnection);
+        }));
+    }
+
+private:
+    static const int maxPendingRecords = 256;
+    static const int maxPendingBytes = 8 << 20;
+    static const int flushIntervalMs = 2000;
+
+    ThumbnailRecords takePending() {
+        ThumbnailRecords records;
+        for (const QString& key : pendingOrder) {
+            records.append(qMakePair(key, pending[key]));
+        }
+        pending.clear();
+        pendingOrder.clear();
+        pendingBytes = 0;
+        return records;
+    }
+
+    void batchWritten(const QSharedPointer<ThumbnailPack>& written) {
+        pack = written;
+        writing.clear();
+        if (!pendingOrder.isEmpty()) {
+            flush();
+        }
+    }
+
+    QString path;
+    qint64 maxBytes;
+    QSharedPointer<ThumbnailPack> pack;
+    QHash<QString, QByteArray> pending;
+    QStringList pendingOrder;
+    int pendingBytes;
+    // The batch on the writer thread, until its pack replaces ours.
+    QHash<QString, QByteArray> writing;
+    QTimer flushTimer;
+    // Receives batchWritten() on the GUI thread; gone with the store.
+    QObject receiver;
+    QThreadPool writer;
+};
+
+static void releaseMappedFile(void* file) {
+    delete static_cast<QFile*>(file);
+}
+
+static QImage mapBitmap(QFile* file, const uchar* data, qint64 size, bool* bottomUp) {
+    if (size < 54 || data[0] != 'B' || data[1] != 'M' || readInteger(data + 14, false, 4) < 40) {
+        return QImage();
+    }
+    quint32 offset = readInteger(data + 10, false, 4);
+    qint32 width = static_cast<qint32>(readInteger(data + 18, false, 4));
+    qint32 height = static_cast<qint32>(readInteger(data + 22, false, 4));
+    quint32 depth = readInteger(data + 28, false, 2);
+    quint32 compression = readInteger(data + 30, false, 4);
+    if (width <= 0 || height == 0 || height == INT_MIN || compression != 0 || (depth != 24 && depth != 32)) {
+        return QImage();
+    }
+    int rows = qAbs(height);
+    qint64 stride = ((static_cast<qint64>(width) * depth / 8) + 3) & ~static_cast<qint64>(3);
+    if (stride > INT_MAX || offset + stride * rows > size) {
+        return QImage();
+    }
+    int bytesPerLine = static_cast<int>(stride);
+    *bottomUp = height > 0;
+    return QImage(data + offset, width, rows, bytesPerLine, depth == 32 ? QImage::Format_RGB32 : QImage::Format_BGR888,
+                  releaseMappedFile, file);
+}
+
+static QImage mapPixmap(QFile* file, const uchar* data, qint64 size) {
+    if (size < 3 || data[0] != 'P' || data[1] != '6') {
+        return QImage();
+    }
+    qint64 pos = 2;
+    int values[3];
+    for (int i = 0; i < 3; ++i) {
+        while (pos < size && (isspace(data[pos]) || data[pos] == '#')) {
+            if (data[pos] == '#') {
+                while (pos < size && data[pos] != '\n') {
+                    ++pos;
+                }
+            } else {
+                ++pos;
+            }
+        }
+        values[i] = 0;
+        if (pos >= size || !isdigit(data[pos])) {
+            return QImage();
+        }
+        while (pos < size && isdigit(data[pos]) && values[i] < (1 << 24)) {
+            values[i] = values[i] * 10 + (data[pos++] - '0');
+        }
+    }
+    ++pos;
+    int bytesPerLine = values[0] * 3;
+    if (values[0] <= 0 || values[1] <= 0 || values[2] != 255 || pos + static_cast<qint64>(bytesPerLine) * values[1] > size) {
+        return QImage();
+    }
+    return QImage(data + pos, values[0], values[1], bytesPerLine, QImage::Format_RGB888, releaseMappedFile, file);
+}
+
+static QImage mapUncompressedImage(QFile* file, const uchar* data, qint64 size, bool* bottomUp) {
+    *bottomUp = false;
+    QImage mapped = mapBitmap(file, data, size, bottomUp);
+    if (mapped.isNull()) {
+        mapped = mapPixmap(file, data, size);
+    }
+    return mapped;
+}
+
+struct PixelTransfer {
+    QOpenGLTexture::PixelFormat format;
+    QOpenGLTexture::PixelType type;
+    QOpenGLTexture::TextureFormat textureFormat;
+    int bytesPerPixel;
+};
+
+static bool pixelTransfer(QImage::Format format, bool redTextures, PixelTransfer* transfer) {
+    transfer->type = QOpenGLTexture::UInt8;
+    switch (format) {
+    case QImage::Format_ARGB32:
+        transfer->format = QOpenGLTexture::BGRA;
+        transfer->textureFormat = QOpenGLTexture::RGBA8_UNorm;
+        transfer->bytesPerPixel = 4;
+        return true;
+    case QImage::Format_RGB32:
+        transfer->format = QOpenGLTexture::BGRA;
+        transfer->textureFormat = QOpenGLTexture::RGB8_UNorm;
+        transfer->bytesPerPixel = 4;
+        return true;
+    case QImage::Format_RGBA8888:
+        transfer->format = QOpenGLTexture::RGBA;
+        transfer->textureFormat = QOpenGLTexture::RGBA8_UNorm;
+        transfer->bytesPerPixel = 4;
+        return true;
+    case QImage::Format_RGBX8888:
+        transfer->format = QOpenGLTexture::RGBA;
+        transfer->textureFormat = QOpenGLTexture::RGB8_UNorm;
+        transfer->bytesPerPixel = 4;
+        return true;
+    case QImage::Format_RGB888:
+        transfer->format = QOpenGLTexture::RGB;
+        transfer->textureFormat = QOpenGLTexture::RGB8_UNorm;
+        transfer->bytesPerPixel = 3;
+        return true;
+    case QImage::Format_BGR888:
+        transfer->format = QOpenGLTexture::BGR;
+        transfer->textureFormat = QOpenGLTexture::RGB8_UNorm;
+        transfer->bytesPerPixel = 3;
+        return true;
+    case QImage::Format_Grayscale8:
+        transfer->format = redTextures ? QOpenGLTexture::Red : QOpenGLTexture::Luminance;
+        transfer->textureFormat = redTextures ? QOpenGLTexture::R8_UNorm : QOpenGLTexture::LuminanceFormat;
+        transfer->bytesPerPixel = 1;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static int texelBytes(QOpenGLTexture::TextureFormat format) {
+    switch (format) {
+    case QOpenGLTexture::R8_UNorm:
+    case QOpenGLTexture::LuminanceFormat:
+        return 1;
+    case QOpenGLTexture::RGB8_UNorm:
+        return 3;
+    default:
+        return 4;
+    }
+}
+
+// Size of S3TC data: 8 bytes (BC1) or 16 bytes (BC3) per 4x4 block.
+static qint64 compressedBytes(const QSize& size, bool alpha) {
+    return static_cast<qint64>((size.width() + 3) / 4) * ((size.height() + 3) / 4) * (alpha ? 16 : 8);
+}
+
+static qint64 textureBytes(const QOpenGLTexture* texture) {
+    if (texture->format() == QOpenGLTexture::RGB_DXT1 || texture->format() == QOpenGLTexture::RGBA_DXT5) {
+        return compressedBytes(QSize(texture->width(), texture->height()), texture->format() == QOpenGLTexture::RGBA_DXT5);
+    }
+    qint64 bytes = static_cast<qint64>(texture->width()) * texture->height() * texelBytes(texture->format());
+    return texture->mipLevels() > 1 ? bytes * 4 / 3 : bytes;
+}
+
+// Pool for splitting one image across cores. It is separate from the decode
+// pool so that a decode job waiting for its parts can never starve them.
+static QThreadPool* bandPool() {
+    static QThreadPool pool;
+    return &pool;
+}
+
+// Runs body(0) .. body(count - 1) concurrently and returns when all are done.
+static void parallelFor(int count, const std::function<void(int)>& body) {
+    QSemaphore finished;
+    for (int i = 1; i < count; ++i) {
+        bandPool()->start(new FunctionJob([&body, &finished, i]() {
+            body(i);
+            finished.release();
+        }));
+    }
+    if (count > 0) {
+        body(0);
+    }
+    finished.acquire(qMax(0, count - 1));
+}
+
+static const qint64 parallelDecodePixels = Q_INT64_C(8) << 20;
+
+static int bandCount(const QSize& size) {
+    if (static_cast<qint64>(size.width()) * size.height() < parallelDecodePixels) {
+        return 1;
+    }
+    return qBound(1, QThread::idealThreadCount(), qMax(1, size.height() / 64));
+}
+
+// convertToFormat() on horizontal bands of a large image, one band per core.
+static QImage convertInBands(const QImage& image, QImage::Format format) {
+    int bands = bandCount(image.size());
+    if (bands <= 1) {
+        return image.convertToFormat(format);
+    }
+    QImage converted(image.size(), format);
+    if (converted.isNull()) {
+        return image.convertToFormat(format);
+    }
+    parallelFor(bands, [&image, &converted, bands, format](int band) {
+        int top = image.height() * band / bands;
+        int bottom = image.height() * (band + 1) / bands;
+        QImage source(image.constScanLine(top), image.width(), bottom - top, image.bytesPerLine(), image.format());
+        source.setColorTable(image.colorTable());
+        QImage part = source.convertToFormat(format);
+        int rowBytes = qMin(part.bytesPerLine(), converted.bytesPerLine());
+        for (int y = 0; y < part.height(); ++y) {
+            memcpy(converted.scanLine(top + y), part.constScanLine(y), rowBytes);
+        }
+    });
+    return converted;
+}
+
+// Row kernels for the conversions that cannot be left to the GPU. Each takes
+// a source row, a destination row and the number of units to convert; the
+// widest variant the CPU supports is chosen once at run time.
+typedef void (*RowKernel)(const uchar* source, uchar* destination, int count);
+
+// 16-bit channels to 8-bit, rounded like Qt's qt_div_257().
+static void narrow16Scalar(const uchar* source, uchar* destination, int count) {
+    const quint16* values = reinterpret_cast<const quint16*>(source);
+    for (int i = 0; i < count; ++i) {
+        destination[i] = static_cast<uchar>((values[i] - (values[i] >> 8) + 0x80) >> 8);
+    }
+}
+
+// BGRA to RGBA, i.e. ARGB32/RGB32 to RGBA8888/RGBX8888 on little-endian hosts.
+static void swizzleBgraScalar(const uchar* source, uchar* destination, int count) {
+    for (int i = 0; i < count; ++i, source += 4, destination += 4) {
+        uchar blue = source[0];
+        destination[0] = source[2];
+        destination[1] = source[1];
+        destination[2] = blue;
+        destination[3] = source[3];
+    }
+}
+
+static void swizzleBgrScalar(const uchar* source, uchar* destination, int count) {
+    for (int i = 0; i < count; ++i, source += 3, destination += 3) {
+        uchar blue = source[0];
+        destination[0] = source[2];
+        destination[1] = source[1];
+        destination[2] = blue;
+    }
+}
+
+#if defined(GRXIV_X86_KERNELS)
+__attribute__((target("sse2")))
+static void narrow16Sse2(const uchar* source, uchar* destination, int count) {
+    const __m128i rounding = _mm_set1_epi16(0x80);
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 2 * i));
+        __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 2 * i + 16));
+        low = _mm_srli_epi16(_mm_add_epi16(_mm_sub_epi16(low, _mm_srli_epi16(low, 8)), rounding), 8);
+        high = _mm_srli_epi16(_mm_add_epi16(_mm_sub_epi16(high, _mm_srli_epi16(high, 8)), rounding), 8);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), _mm_packus_epi16(low, high));
+    }
+    narrow16Scalar(source + 2 * i, destination + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void narrow16Avx2(const uchar* source, uchar* destination, int count) {
+    const __m256i rounding = _mm256_set1_epi16(0x80);
+    int i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + 2 * i));
+        __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + 2 * i + 32));
+        low = _mm256_srli_epi16(_mm256_add_epi16(_mm256_sub_epi16(low, _mm256_srli_epi16(low, 8)), rounding), 8);
+        high = _mm256_srli_epi16(_mm256_add_epi16(_mm256_sub_epi16(high, _mm256_srli_epi16(high, 8)), rounding), 8);
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(low, high), 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + i), packed);
+    }
+    narrow16Scalar(source + 2 * i, destination + i, count - i);
+}
+
+__attribute__((target("ssse3")))
+static void swizzleBgraSsse3(const uchar* source, uchar* destination, int count) {
+    const __m128i order = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 4 * i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + 4 * i), _mm_shuffle_epi8(pixels, order));
+    }
+    swizzleBgraScalar(source + 4 * i, destination + 4 * i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void swizzleBgraAvx2(const uchar* source, uchar* destination, int count) {
+    const __m256i order = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + 4 * i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + 4 * i), _mm256_shuffle_epi8(pixels, order));
+    }
+    swizzleBgraScalar(source + 4 * i, destination + 4 * i, count - i);
+}
+
+// Converts four pixels per 16-byte load; the four trailing bytes of each
+// store are rewritten by the next iteration, so the loop stops while at
+// least 16 bytes of the row remain.
+__attribute__((target("ssse3")))
+static void swizzleBgrSsse3(const uchar* source, uchar* destination, int count) {
+    const __m128i order = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 12, 13, 14, 15);
+    int i = 0;
+    for (; i + 6 <= count; i += 4) {
+        __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 3 * i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + 3 * i), _mm_shuffle_epi8(pixels, order));
+    }
+    swizzleBgrScalar(source + 3 * i, destination + 3 * i, count - i);
+}
+#elif defined(GRXIV_NEON_KERNELS)
+static void narrow16Neon(const uchar* source, uchar* destination, int count) {
+    const uint16x8_t rounding = vdupq_n_u16(0x80);
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint16x8_t low = vld1q_u16(reinterpret_cast<const uint16_t*>(source + 2 * i));
+        uint16x8_t high = vld1q_u16(reinterpret_cast<const uint16_t*>(source + 2 * i + 16));
+        low = vshrq_n_u16(vaddq_u16(vsubq_u16(low, vshrq_n_u16(low, 8)), rounding), 8);
+        high = vshrq_n_u16(vaddq_u16(vsubq_u16(high, vshrq_n_u16(high, 8)), rounding), 8);
+        vst1q_u8(destination + i, vcombine_u8(vmovn_u16(low), vmovn_u16(high)));
+    }
+    narrow16Scalar(source + 2 * i, destination + i, count - i);
+}
+
+static void swizzleBgraNeon(const uchar* source, uchar* destination, int count) {
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x4_t pixels = vld4q_u8(source + 4 * i);
+        uint8x16_t blue = pixels.val[0];
+        pixels.val[0] = pixels.val[2];
+        pixels.val[2] = blue;
+        vst4q_u8(destination + 4 * i, pixels);
+    }
+    swizzleBgraScalar(source + 4 * i, destination + 4 * i, count - i);
+}
+
+static void swizzleBgrNeon(const uchar* source, uchar* destination, int count) {
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x3_t pixels = vld3q_u8(source + 3 * i);
+        uint8x16_t blue = pixels.val[0];
+        pixels.val[0] = pixels.val[2];
+        pixels.val[2] = blue;
+        vst3q_u8(destination + 3 * i, pixels);
+    }
+    swizzleBgrScalar(source + 3 * i, destination + 3 * i, count - i);
+}
+#endif
+
+struct ConversionKernels {
+    RowKernel narrow16;
+    RowKernel swizzleBgra;
+    RowKernel swizzleBgr;
+};
+
+static ConversionKernels selectConversionKernels() {
+    ConversionKernels kernels;
+    kernels.narrow16 = narrow16Scalar;
+    kernels.swizzleBgra = swizzleBgraScalar;
+    kernels.swizzleBgr = swizzleBgrScalar;
+#if defined(GRXIV_X86_KERNELS)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        kernels.narrow16 = narrow16Sse2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        kernels.swizzleBgra = swizzleBgraSsse3;
+        kernels.swizzleBgr = swizzleBgrSsse3;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.narrow16 = narrow16Avx2;
+        kernels.swizzleBgra = swizzleBgraAvx2;
+    }
+#elif defined(GRXIV_NEON_KERNELS)
+    kernels.narrow16 = narrow16Neon;
+    kernels.swizzleBgra = swizzleBgraNeon;
+    kernels.swizzleBgr = swizzleBgrNeon;
+#endif
+    return kernels;
+}
+
+static const ConversionKernels& conversionKernels() {
+    static const ConversionKernels kernels = selectConversionKernels();
+    return kernels;
+}
+
+// Applies kernel to every row, splitting large images across cores.
+// unitsPerPixel is the number of kernel units (channels or pixels) per pixel.
+static QImage convertRows(const QImage& image, QImage::Format format, RowKernel kernel, int unitsPerPixel) {
+    QImage converted(image.size(), format);
+    if (converted.isNull()) {
+        return image.convertToFormat(format);
+    }
+    int bands = bandCount(image.size());
+    parallelFor(bands, [&image, &converted, bands, kernel, unitsPerPixel](int band) {
+        int bottom = image.height() * (band + 1) / bands;
+        for (int y = image.height() * band / bands; y < bottom; ++y) {
+            kernel(image.constScanLine(y), converted.scanLine(y), image.width() * unitsPerPixel);
+        }
+    });
+    return converted;
+}
+
+// For contexts that cannot take BGRA or BGR pixel data (OpenGL ES without
+// GL_EXT_texture_format_BGRA8888), reorders the channels on the CPU.
+static QImage rgbOrderedImage(const QImage& image) {
+    bool littleEndian = QSysInfo::ByteOrder == QSysInfo::LittleEndian;
+    switch (image.format()) {
+    case QImage::Format_ARGB32:
+        return littleEndian ? convertRows(image, QImage::Format_RGBA8888, conversionKernels().swizzleBgra, 1)
+                            : image.convertToFormat(QImage::Format_RGBA8888);
+    case QImage::Format_RGB32:
+        return littleEndian ? convertRows(image, QImage::Format_RGBX8888, conversionKernels().swizzleBgra, 1)
+                            : image.convertToFormat(QImage::Format_RGBX8888);
+    case QImage::Format_BGR888:
+        return convertRows(image, QImage::Format_RGB888, conversionKernels().swizzleBgr, 1);
+    default:
+        return image;
+    }
+}
+
+static QImage uploadableImage(const QImage& image) {
+    switch (image.format()) {
+    case QImage::Format_ARGB32:
+    case QImage::Format_RGB32:
+    case QImage::Format_RGBA8888:
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGB888:
+    case QImage::Format_BGR888:
+    case QImage::Format_Grayscale8:
+        return image;
+    case QImage::Format_Grayscale16:
+        return convertRows(image, QImage::Format_Grayscale8, conversionKernels().narrow16, 1);
+    case QImage::Format_RGBA64:
+        return convertRows(image, QImage::Format_RGBA8888, conversionKernels().narrow16, 4);
+    case QImage::Format_RGBX64:
+        return convertRows(image, QImage::Format_RGBX8888, conversionKernels().narrow16, 4);
+    case QImage::Format_Mono:
+    case QImage::Format_MonoLSB:
+    case QImage::Format_Indexed8:
+        if (!image.hasAlphaChannel() && image.isGrayscale()) {
+            return convertInBands(image, QImage::Format_Grayscale8);
+        }
+        break;
+    default:
+        break;
+    }
+    return convertInBands(image, image.hasAlphaChannel() ? QImage::Format_RGBA8888 : QImage::Format_RGB888);
+}
+
+// A texture transcoded to BC1 (opaque) or BC3 (with alpha), top row first.
+struct CompressedTexture {
+    QSize size;
+    bool alpha;
+    QByteArray blocks;
+
+    CompressedTexture() : alpha(false) {}
+
+    bool isNull() const {
+        return blocks.isEmpty();
+    }
+};
+
+static quint16 packRgb565(const int* rgb) {
+    return static_cast<quint16>(((rgb[0] >> 3) << 11) | ((rgb[1] >> 2) << 5) | (rgb[2] >> 3));
+}
+
+static void unpackRgb565(quint16 color, int* rgb) {
+    int red = (color >> 11) & 31;
+    int green = (color >> 5) & 63;
+    int blue = color & 31;
+    rgb[0] = (red << 3) | (red >> 2);
+    rgb[1] = (green << 2) | (green >> 4);
+    rgb[2] = (blue << 3) | (blue >> 2);
+}
+
+static void storeLittleEndian(uchar* out, quint64 value, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        out[i] = static_cast<uchar>(value >> (8 * i));
+    }
+}
+
+// Single-pass encoder in the style of real-time DXT compression: the
+// endpoints are the block's colour bounding box inset by 1/16, and every
+// pixel takes the palette entry nearest its projection onto that diagonal.
+static void encodeColorBlock(const uchar (*pixels)[4], uchar* out) {
+    int low[3] = { 255, 255, 255 };
+    int high[3] = { 0, 0, 0 };
+    for (int i = 0; i < 16; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            low[c] = qMin(low[c], static_cast<int>(pixels[i][c]));
+            high[c] = qMax(high[c], static_cast<int>(pixels[i][c]));
+        }
+    }
+    for (int c = 0; c < 3; ++c) {
+        int inset = (high[c] - low[c]) >> 4;
+        low[c] += inset;
+        high[c] -= inset;
+    }
+    quint16 first = packRgb565(high);
+    quint16 second = packRgb565(low);
+    quint32 indices = 0;
+    if (first != second) {
+        static const int paletteIndex[4] = { 1, 3, 2, 0 };
+        int start[3];
+        int end[3];
+        unpackRgb565(second, start);
+        unpackRgb565(first, end);
+        int axis[3] = { end[0] - start[0], end[1] - start[1], end[2] - start[2] };
+        int length = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+        for (int i = 0; i < 16; ++i) {
+            int projection = (pixels[i][0] - start[0]) * axis[0] + (pixels[i][1] - start[1]) * axis[1] + (pixels[i][2] - start[2]) * axis[2];
+            int level = qBound(0, (projection * 3 + length / 2) / length, 3);
+            indices |= static_cast<quint32>(paletteIndex[level]) << (2 * i);
+        }
+    }
+    storeLittleEndian(out, first, 2);
+    storeLittleEndian(out + 2, second, 2);
+    storeLittleEndian(out + 4, indices, 4);
+}
+
+static void encodeAlphaBlock(const uchar (*pixels)[4], uchar* out) {
+    int low = 255;
+    int high = 0;
+    for (int i = 0; i < 16; ++i) {
+        low = qMin(low, static_cast<int>(pixels[i][3]));
+        high = qMax(high, static_cast<int>(pixels[i][3]));
+    }
+    quint64 indices = 0;
+    if (high > low) {
+        int range = high - low;
+        for (int i = 0; i < 16; ++i) {
+            int level = ((pixels[i][3] - low) * 7 + range / 2) / range;
+            int index = level == 7 ? 0 : (level == 0 ? 1 : 8 - level);
+            indices |= static_cast<quint64>(index) << (3 * i);
+        }
+    }
+    out[0] = static_cast<uchar>(high);
+    out[1] = static_cast<uchar>(low);
+    storeLittleEndian(out + 2, indices, 6);
+}
+
+static CompressedTexture compressTexture(const QImage& image, bool bottomUp) {
+    CompressedTexture compressed;
+    compressed.alpha = image.hasAlphaChannel();
+    QImage source = convertInBands(image, compressed.alpha ? QImage::Format_RGBA8888 : QImage::Format_RGBX8888);
+    if (source.isNull()) {
+        return compressed;
+    }
+    compressed.size = source.size();
+    compressed.blocks.resize(static_cast<int>(compressedBytes(compressed.size, compressed.alpha)));
+    int blockColumns = (source.width() + 3) / 4;
+    int blockRows = (source.height() + 3) / 4;
+    int blockBytes = compressed.alpha ? 16 : 8;
+    uchar* out = reinterpret_cast<uchar*>(compressed.blocks.data());
+    int bands = bandCount(source.size());
+    parallelFor(bands, [&source, out, bottomUp, blockColumns, blockRows, blockBytes, bands, &compressed](int band) {
+        uchar pixels[16][4];
+        for (int blockRow = blockRows * band / bands; blockRow < blockRows * (band + 1) / bands; ++blockRow) {
+            for (int blockColumn = 0; blockColumn < blockColumns; ++blockColumn) {
+                // Edge blocks repeat the last row and column.
+                for (int y = 0; y < 4; ++y) {
+                    int row = qMin(blockRow * 4 + y, source.height() - 1);
+                    const uchar* line = source.constScanLine(bottomUp ? source.height() - 1 - row : row);
+                    for (int x = 0; x < 4; ++x) {
+                        memcpy(pixels[y * 4 + x], line + 4 * qMin(blockColumn * 4 + x, source.width() - 1), 4);
+                    }
+                }
+                uchar* block = out + (static_cast<qint64>(blockRow) * blockColumns + blockColumn) * blockBytes;
+                if (compressed.alpha) {
+                    encodeAlphaBlock(pixels, block);
+                    block += 8;
+                }
+                encodeColorBlock(pixels, block);
+            }
+        }
+    });
+    return compressed;
+}
+
+// Thumbnail store record of a compressed texture: little-endian width,
+// height, source width, source height and alpha flag, then the blocks.
+static QByteArray compressedRecord(const CompressedTexture& compressed, const QSize& sourceSize) {
+    QByteArray record;
+    record.reserve(compressed.blocks.size() + 20);
+    appendInteger(&record, compressed.size.width());
+    appendInteger(&record, compressed.size.height());
+    appendInteger(&record, sourceSize.width());
+    appendInteger(&record, sourceSize.height());
+    appendInteger(&record, compressed.alpha ? 1 : 0);
+    record.append(compressed.blocks);
+    return record;
+}
+
+static bool readCompressedRecord(const QByteArray& record, CompressedTexture* compressed, QSize* sourceSize) {
+    if (record.size() < 20) {
+        return false;
+    }
+    const uchar* data = reinterpret_cast<const uchar*>(record.constData());
+    QSize size(static_cast<int>(readInteger(data, false, 4)), static_cast<int>(readInteger(data + 4, false, 4)));
+    bool alpha = readInteger(data + 16, false, 4) != 0;
+    if (size.isEmpty() || compressedBytes(size, alpha) != record.size() - 20) {
+        return false;
+    }
+    compressed->size = size;
+    compressed->alpha = alpha;
+    compressed->blocks = record.mid(20);
+    *sourceSize = QSize(static_cast<int>(readInteger(data + 8, false, 4)), static_cast<int>(readInteger(data + 12, false, 4)));
+    return true;
+}
+
+static bool tiffThumbnailRange(const uchar* tiff, int size, int* offset, int* length) {
+    if (size < 8) {
+        return false;
+    }
+    bool bigEndian = tiff[0] == 'M' && tiff[1] == 'M';
+    if (!bigEndian && !(tiff[0] == 'I' && tiff[1] == 'I')) {
+        return false;
+    }
+    // The header is untrusted, so offsets are widened before anything is
+    // added to them.
+    qint64 ifd = readInteger(tiff + 4, bigEndian, 4);
+    if (ifd > size - 2) {
+        return false;
+    }
+    qint64 entries = readInteger(tiff + ifd, bigEndian, 2);
+    qint64 next = ifd + 2 + entries * 12;
+    if (next > size - 4) {
+        return false;
+    }
+    ifd = readInteger(tiff + next, bigEndian, 4);
+    if (ifd == 0 || ifd > size - 2) {
+        return false;
+    }
+    entries = readInteger(tiff + ifd, bigEndian, 2);
+    qint64 thumbnailOffset = 0;
+    qint64 thumbnailLength = 0;
+    for (qint64 i = 0; i < entries; ++i) {
+        qint64 entry = ifd + 2 + i * 12;
+        if (entry > size - 12) {
+            return false;
+        }
+        quint32 tag = readInteger(tiff + entry, bigEndian, 2);
+        quint32 type = readInteger(tiff + entry + 2, bigEndian, 2);
+        quint32 value = readInteger(tiff + entry + 8, bigEndian, type == 3 ? 2 : 4);
+        if (tag == 0x0201) {
+            thumbnailOffset = value;
+        } else if (tag == 0x0202) {
+            thumbnailLength = value;
+        }
+    }
+    if (thumbnailOffset == 0 || thumbnailLength == 0 || thumbnailOffset > size || thumbnailLength > size - thumbnailOffset) {
+        return false;
+    }
+    *offset = static_cast<int>(thumbnailOffset);
+    *length = static_cast<int>(thumbnailLength);
+    return true;
+}
+
+static bool exifThumbnailRange(const uchar* data, int size, int* offset, int* length) {
+    if (size >= 4 && ((data[0] == 'I' && data[1] == 'I') || (data[0] == 'M' && data[1] == 'M'))) {
+        return tiffThumbnailRange(data, size, offset, length);
+    }
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+        return false;
+    }
+    int pos = 2;
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xFF) {
+            return false;
+        }
+        uchar marker = data[pos + 1];
+        if (marker == 0xFF) {
+            ++pos;
+            continue;
+        }
+        if (marker == 0xDA || marker == 0xD9) {
+            return false;
+        }
+        int segmentLength = (data[pos + 2] << 8) | data[pos + 3];
+        if (segmentLength < 2) {
+            return false;
+        }
+        const uchar* segment = data + pos + 4;
+        int segmentSize = qMin(segmentLength - 2, size - pos - 4);
+        if (marker == 0xE1 && segmentSize > 6 && memcmp(segment, "Exif\0\0", 6) == 0
+            && tiffThumbnailRange(segment + 6, segmentSize - 6, offset, length)) {
+            *offset += pos + 4 + 6;
+            return true;
+        }
+        pos += 2 + segmentLength;
+    }
+    return false;
+}
+
+#ifdef GRXIV_TURBOJPEG
+// Decodes through TurboJPEG, with its SIMD IDCT, straight into an image in
+// an upload format. For a valid targetSize the smallest DCT scaling factor
+// whose result still covers the image fitted to it is used. CMYK and
+// anything TurboJPEG rejects return a null image and go through
+// QImageReader instead.
+static QImage decodeTurboJpeg(const uchar* data, qint64 size, const QSize& targetSize, QSize* sourceSize) {
+    if (size < 4 || size > INT_MAX || data[0] != 0xFF || data[1] != 0xD8) {
+        return QImage();
+    }
+    tjhandle handle = tjInitDecompress();
+    if (!handle) {
+        return QImage();
+    }
+    unsigned long length = static_cast<unsigned long>(size);
+    int width = 0;
+    int height = 0;
+    int subsampling = 0;
+    int colorspace = 0;
+    if (tjDecompressHeader3(handle, data, length, &width, &height, &subsampling, &colorspace) != 0
+        || colorspace == TJCS_CMYK || colorspace == TJCS_YCCK || width <= 0 || height <= 0) {
+        tjDestroy(handle);
+        return QImage();
+    }
+    int scaledWidth = width;
+    int scaledHeight = height;
+    if (targetSize.isValid() && (width > targetSize.width() || height > targetSize.height())) {
+        QSize fitted = QSize(width, height).scaled(targetSize, Qt::KeepAspectRatio);
+        int count = 0;
+        tjscalingfactor* factors = tjGetScalingFactors(&count);
+        for (int i = 0; factors && i < count; ++i) {
+            if (factors[i].num > factors[i].denom) {
+                continue;
+            }
+            int factorWidth = TJSCALED(width, factors[i]);
+            int factorHeight = TJSCALED(height, factors[i]);
+            if (factorWidth >= fitted.width() && factorHeight >= fitted.height() && factorWidth < scaledWidth) {
+                scaledWidth = factorWidth;
+                scaledHeight = factorHeight;
+            }
+        }
+    }
+    bool gray = colorspace == TJCS_GRAY;
+    QImage image(scaledWidth, scaledHeight, gray ? QImage::Format_Grayscale8 : QImage::Format_RGBX8888);
+    if (image.isNull()) {
+        tjDestroy(handle);
+        return QImage();
+    }
+    // Warnings, such as a truncated file, still leave a usable image, as
+    // they do in QImageReader.
+    if (tjDecompress2(handle, data, length, image.bits(), scaledWidth, image.bytesPerLine(), scaledHeight,
+                      gray ? TJPF_GRAY : TJPF_RGBX, 0) != 0
+        && tjGetErrorCode(handle) != TJERR_WARNING) {
+        image = QImage();
+    }
+    tjDestroy(handle);
+    if (sourceSize) {
+        *sourceSize = QSize(width, height);
+    }
+    return image;
+}
+#endif
+
+// One self-contained JPEG in memory, through TurboJPEG when it is built in.
+static QImage decodeJpegData(QByteArray& jpeg) {
+#ifdef GRXIV_TURBOJPEG
+    QImage image = decodeTurboJpeg(reinterpret_cast<const uchar*>(jpeg.constData()), jpeg.size(), QSize(), nullptr);
+    if (!image.isNull()) {
+        return image;
+    }
+#endif
+    QBuffer buffer(&jpeg);
+    buffer.open(QIODevice::ReadOnly);
+    QImageReader reader(&buffer, "jpeg");
+    return reader.read();
+}
+
+// Baseline JPEGs whose restart intervals line up with MCU rows can be cut
+// into independent bands: each band gets a copy of the headers with its own
+// height and the entropy-coded data between two restart markers, renumbered
+// from RST0. The bands are decoded on all cores and stitched back together.
+// Progressive, arithmetic-coded or restart-less files return a null image.
+static QImage decodeJpegInBands(const uchar* data, qint64 size) {
+    if (size < 4 || size > INT_MAX || data[0] != 0xFF || data[1] != 0xD8) {
+        return QImage();
+    }
+    int width = 0;
+    int height = 0;
+    int heightOffset = -1;
+    int mcuWidth = 8;
+    int mcuHeight = 8;
+    int restartInterval = 0;
+    qint64 scanStart = -1;
+    qint64 offset = 2;
+    while (scanStart < 0 && offset + 4 <= size) {
+        if (data[offset] != 0xFF) {
+            return QImage();
+        }
+        uchar marker = data[offset + 1];
+        if (marker == 0xFF) {
+            ++offset;
+            continue;
+        }
+        int length = static_cast<int>(readInteger(data + offset + 2, true, 2));
+        if (length < 2 || offset + 2 + length > size) {
+            return QImage();
+        }
+        const uchar* segment = data + offset + 4;
+        if (marker == 0xC0 || marker == 0xC1) {
+            int components = length >= 8 ? segment[5] : 0;
+            if (components == 0 || length < 8 + components * 3) {
+                return QImage();
+            }
+            height = static_cast<int>(readInteger(segment + 1, true, 2));
+            width = static_cast<int>(readInteger(segment + 3, true, 2));
+            heightOffset = static_cast<int>(offset + 5);
+            int horizontal = 1;
+            int vertical = 1;
+            for (int c = 0; c < components; ++c) {
+                horizontal = qMax(horizontal, segment[7 + c * 3] >> 4);
+                vertical = qMax(vertical, segment[7 + c * 3] & 0x0F);
+            }
+            mcuWidth = 8 * horizontal;
+            mcuHeight = 8 * vertical;
+        } else if (marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            return QImage();
+        } else if (marker == 0xDD && length >= 4) {
+            restartInterval = static_cast<int>(readInteger(segment, true, 2));
+        } else if (marker == 0xDA) {
+            scanStart = offset + 2 + length;
+        }
+        offset += 2 + length;
+    }
+    int bands = bandCount(QSize(width, height));
+    if (scanStart < 0 || heightOffset < 0 || restartInterval <= 0 || width <= 0 || height <= 0 || bands <= 1) {
+        return QImage();
+    }
+
+    QVector<qint64> restarts;
+    qint64 scanEnd = -1;
+    for (qint64 i = scanStart; i + 1 < size;) {
+        const void* found = memchr(data + i, 0xFF, size - 1 - i);
+        if (!found) {
+            break;
+        }
+        i = static_cast<const uchar*>(found) - data;
+        uchar next = data[i + 1];
+        if (next >= 0xD0 && next <= 0xD7) {
+            restarts.append(i);
+            i += 2;
+        } else if (next == 0xD9) {
+            scanEnd = i;
+            break;
+        } else if (next == 0x00 || next == 0xFF) {
+            i += 1;
+        } else {
+            return QImage();
+        }
+    }
+    int mcusPerRow = (width + mcuWidth - 1) / mcuWidth;
+    int mcuRows = (height + mcuHeight - 1) / mcuHeight;
+    int intervals = restarts.size() + 1;
+    if (scanEnd < 0 || intervals != (static_cast<qint64>(mcusPerRow) * mcuRows + restartInterval - 1) / restartInterval) {
+        return QImage();
+    }
+
+    // Band boundaries, as indices of the first restart interval of each band.
+    QVector<int> bounds;
+    bounds.append(0);
+    for (int k = 1; k < intervals && bounds.size() < bands; ++k) {
+        qint64 firstMcu = static_cast<qint64>(k) * restartInterval;
+        if (firstMcu % mcusPerRow == 0 && firstMcu / mcusPerRow >= static_cast<qint64>(mcuRows) * bounds.size() / bands) {
+            bounds.append(k);
+        }
+    }
+    bounds.append(intervals);
+    bands = bounds.size() - 1;
+    if (bands <= 1) {
+        return QImage();
+    }
+
+    QVector<QImage> parts(bands);
+    parallelFor(bands, [&](int band) {
+        int first = bounds[band];
+        int last = bounds[band + 1];
+        int top = static_cast<int>(static_cast<qint64>(first) * restartInterval / mcusPerRow) * mcuHeight;
+        int bottom = band + 1 == bands ? height : static_cast<int>(static_cast<qint64>(last) * restartInterval / mcusPerRow) * mcuHeight;
+        qint64 from = first == 0 ? scanStart : restarts[first - 1] + 2;
+        qint64 to = last == intervals ? scanEnd : restarts[last - 1];
+        QByteArray jpeg;
+        jpeg.reserve(static_cast<int>(scanStart + to - from + 2));
+        jpeg.append(reinterpret_cast<const char*>(data), static_cast<int>(scanStart));
+        jpeg[heightOffset] = static_cast<char>((bottom - top) >> 8);
+        jpeg[heightOffset + 1] = static_cast<char>((bottom - top) & 0xFF);
+        jpeg.append(reinterpret_cast<const char*>(data + from), static_cast<int>(to - from));
+        for (int k = first; k < last - 1; ++k) {
+            jpeg[static_cast<int>(scanStart + restarts[k] - from + 1)] = static_cast<char>(0xD0 + (k - first) % 8);
+        }
+        jpeg.append("\xFF\xD9", 2);
+        parts[band] = decodeJpegData(jpeg);
+        if (parts[band].size() != QSize(width, bottom - top)) {
+            parts[band] = QImage();
+        }
+    });
+    for (const QImage& part : parts) {
+        if (part.isNull() || part.format() != parts[0].format()) {
+            return QImage();
+        }
+    }
+
+    QImage image(width, height, parts[0].format());
+    if (image.isNull()) {
+        return QImage();
+    }
+    image.setColorTable(parts[0].colorTable());
+    QVector<int> tops(bands);
+    for (int band = 1; band < bands; ++band) {
+        tops[band] = tops[band - 1] + parts[band - 1].height();
+    }
+    parallelFor(bands, [&](int band) {
+        const QImage& part = parts[band];
+        int rowBytes = qMin(part.bytesPerLine(), image.bytesPerLine());
+        for (int y = 0; y < part.height(); ++y) {
+            memcpy(image.scanLine(tops[band] + y), part.constScanLine(y), rowBytes);
+        }
+    });
+    return image;
+}
+
+static const char vertexShaderSource[] =
+    "#version 120\n"
+    "attribute vec2 position;\n"
+    "attribute vec2 texCoord;\n"
+    "varying vec2 vTexCoord;\n"
+    "uniform mat4 mvp;\n"
+    "void main() {\n"
+    "    gl_Position = mvp * vec4(position, 0.0, 1.0);\n"
+    "    vTexCoord = texCoord;\n"
+    "}\n";
+
+static const char fragmentShaderSource[] =
+    "#version 120\n"
+    "varying vec2 vTexCoord;\n"
+    "uniform sampler2D tex;\n"
+    "uniform bool grayscale;\n"
+    "uniform bool downscale;\n"
+    "uniform vec2 texelSize;\n"
+    "uniform float scale;\n"
+    "float lanczos(float x) {\n"
+    "    if (abs(x) < 0.0001) {\n"
+    "        return 1.0;\n"
+    "    }\n"
+    "    if (abs(x) >= 2.0) {\n"
+    "        return 0.0;\n"
+    "    }\n"
+    "    float px = 3.14159265 * x;\n"
+    "    return 2.0 * sin(px) * sin(px * 0.5) / (px * px);\n"
+    "}\n"
+    "vec4 sampleImage() {\n"
+    "    if (!downscale) {\n"
+    "        return texture2D(tex, vTexCoord);\n"
+    "    }\n"
+    "    vec2 center = vTexCoord / texelSize - 0.5;\n"
+    "    vec2 base = floor(center);\n"
+    "    vec4 sum = vec4(0.0);\n"
+    "    float total = 0.0;\n"
+    "    for (int j = -3; j <= 4; ++j) {\n"
+    "        float wy = lanczos((base.y + float(j) - center.y) / scale);\n"
+    "        for (int i = -3; i <= 4; ++i) {\n"
+    "            float w = wy * lanczos((base.x + float(i) - center.x) / scale);\n"
+    "            sum += w * texture2D(tex, (base + vec2(float(i), float(j)) + 0.5) * texelSize);\n"
+    "            total += w;\n"
+    "        }\n"
+    "    }\n"
+    "    return sum / total;\n"
+    "}\n"
+    "void main() {\n"
+    "    vec4 color = sampleImage();\n"
+    "    gl_FragColor = grayscale ? vec4(color.rrr, color.a) : color;\n"
+    "}\n";
+
+// Compare mode's difference view: the per-channel absolute difference of an
+// image and the reference, both sampled at the same texture coordinates.
+static const char differenceFragmentShaderSource[] =
+    "#version 120\n"
+    "varying vec2 vTexCoord;\n"
+    "uniform sampler2D image;\n"
+    "uniform sampler2D reference;\n"
+    "uniform bool imageGrayscale;\n"
+    "uniform bool referenceGrayscale;\n"
+    "uniform float gain;\n"
+    "void main() {\n"
+    "    vec4 a = texture2D(image, vTexCoord);\n"
+    "    vec4 b = texture2D(reference, vTexCoord);\n"
+    "    vec3 difference = abs((imageGrayscale ? a.rrr : a.rgb) - (referenceGrayscale ? b.rrr : b.rgb));\n"
+    "    gl_FragColor = vec4(min(difference * gain, 1.0), 1.0);\n"
+    "}\n";
+
+// Gain of the amplified difference view, making off-by-a-few errors visible.
+static const float amplifiedDifferenceGain = 16.0f;
+
+// Widest minification the Lanczos path of the fragment shader covers with its
+// 8x8 footprint; beyond that the texture needs a mip chain.
+static const qreal maxShaderDownscale = 2.0;
+
+static const char gridVertexShaderSource[] =
+    "#version 120\n"
+    "attribute vec2 corner;\n"
+    "attribute vec4 cellRect;\n"
+    "attribute vec4 atlasRect;\n"
+    "attribute float atlasIndex;\n"
+    "varying vec2 vTexCoord;\n"
+    "varying float vAtlas;\n"
+    "void main() {\n"
+    "    gl_Position = vec4(mix(cellRect.xy, cellRect.zw, corner), 0.0, 1.0);\n"
+    "    vTexCoord = mix(atlasRect.xy, atlasRect.zw, corner);\n"
+    "    vAtlas = atlasIndex;\n"
+    "}\n";
+
+static const char gridFragmentShaderSource[] =
+    "#version 120\n"
+    "varying vec2 vTexCoord;\n"
+    "varying float vAtlas;\n"
+    "uniform sampler2D atlas0;\n"
+    "uniform sampler2D atlas1;\n"
+    "uniform sampler2D atlas2;\n"
+    "uniform sampler2D atlas3;\n"
+    "void main() {\n"
+    "    if (vAtlas < 0.5) {\n"
+    "        gl_FragColor = texture2D(atlas0, vTexCoord);\n"
+    "    } else if (vAtlas < 1.5) {\n"
+    "        gl_FragColor = texture2D(atlas1, vTexCoord);\n"
+    "    } else if (vAtlas < 2.5) {\n"
+    "        gl_FragColor = texture2D(atlas2, vTexCoord);\n"
+    "    } else {\n"
+    "        gl_FragColor = texture2D(atlas3, vTexCoord);\n"
+    "    }\n"
+    "}\n";
+
+static const float gridCorners[] = {
+    0.0f, 0.0f,
+    1.0f, 0.0f,
+    1.0f, 1.0f,
+    0.0f, 1.0f
+};
+
+static const float quadVertices[] = {
+    -1.0f, -1.0f, 0.0f, 1.0f,
+     1.0f, -1.0f, 1.0f, 1.0f,
+     1.0f,  1.0f, 1.0f, 0.0f,
+    -1.0f,  1.0f, 0.0f, 0.0f
+};
+
+static const unsigned int quadIndices[] = {
+    0, 1, 2,
+    2, 3, 0
+};
+
+struct DecodeRequest {
+    QString key;
+    QString path;
+    QSize targetSize;
+    bool preview;
+    bool cell;
+    int priority;
+    // Stored thumbnail to show as the preview instead of the EXIF one.
+    QByteArray thumbnail;
+    // When set, the decoded image is also encoded as a thumbnail for the store.
+    QString thumbnailKey;
+    // When set, the image is delivered as BC1/BC3 blocks, taken from
+    // compressedRecord if the store had them and encoded otherwise.
+    QString compressedKey;
+    QByteArray compressedRecord;
+
+    DecodeRequest() : preview(false), cell(false), priority(0) {}
+
+    QString id() const {
+        if (cell) {
+            return key + "#cell";
+        }
+        if (preview) {
+            return key + "#preview";
+        }
+        return key + (targetSize.isValid() ? "#reduced" : "#full");
+    }
+};
+
+struct DecodedImage {
+    QImage image;
+    QSize sourceSize;
+    bool bottomUp;
+    double decodeMs;
+    QByteArray thumbnail;
+    // The file holds more than one frame and is played by AnimationPlayer.
+    bool animated;
+    // Replaces image when the request asked for compressed blocks.
+    CompressedTexture compressed;
+    // Newly encoded blocks to add to the store.
+    QByteArray compressedRecord;
+    // image points into a shared mapping of the file, which faults once the
+    // file is truncated, so it is only uploaded from and never cached.
+    bool mapped;
+
+    DecodedImage() : bottomUp(false), decodeMs(0.0), animated(false), mapped(false) {}
+};
+
+static const int thumbnailSize = 256;
+
+static QByteArray encodeThumbnail(const QImage& image, bool bottomUp) {
+    QImage thumbnail = image;
+    if (thumbnail.width() > thumbnailSize || thumbnail.height() > thumbnailSize) {
+        thumbnail = thumbnail.scaled(thumbnailSize, thumbnailSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+    }
+    if (bottomUp) {
+        thumbnail = thumbnail.mirrored(false, true);
+    }
+    QByteArray encoded;
+    QBuffer buffer(&encoded);
+    buffer.open(QIODevice::WriteOnly);
+    if (thumbnail.hasAlphaChannel()) {
+        thumbnail.save(&buffer, "PNG");
+    } else {
+        thumbnail.save(&buffer, "JPEG", 85);
+    }
+    return encoded;
+}
+
+static const int gridSlotSize = 128;
+
+// Fits a decoded image into a grid atlas slot, oriented top-down.
+static QImage cellImage(const QImage& image, bool bottomUp) {
+    QImage cell = image.scaled(gridSlotSize, gridSlotSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+    if (bottomUp) {
+        cell = cell.mirrored(false, true);
+    }
+    return cell.convertToFormat(QImage::Format_RGBA8888);
+}
+
+class DecodeJob : public QRunnable {
+public:
+    typedef std::function<void(const DecodeRequest&, const DecodedImage&)> Callback;
+
+    DecodeJob(const DecodeRequest& request, const QSharedPointer<QAtomicInt>& cancelled, QObject* receiver, const Callback& callback)
+        : request(request), cancelled(cancelled), receiver(receiver), callback(callback) {}
+
+    void run() override {
+        if (cancelled->loadAcquire()) {
+            return;
+        }
+        QElapsedTimer timer;
+        timer.start();
+        DecodedImage decoded = decode();
+        decoded.decodeMs = elapsedMilliseconds(timer);
+        if (!request.thumbnailKey.isEmpty() && !decoded.image.isNull()) {
+            decoded.thumbnail = encodeThumbnail(decoded.image, decoded.bottomUp);
+        }
+        if (request.cell && !decoded.image.isNull()) {
+            decoded.image = cellImage(decoded.image, decoded.bottomUp);
+            decoded.bottomUp = false;
+        }
+        if (!request.compressedKey.isEmpty() && !decoded.image.isNull()) {
+            decoded.compressed = compressTexture(decoded.image, decoded.bottomUp);
+            if (!decoded.compressed.isNull()) {
+                decoded.compressedRecord = compressedRecord(decoded.compressed, decoded.sourceSize);
+                decoded.image = QImage();
+                decoded.bottomUp = false;
+            }
+        }
+        if (cancelled->loadAcquire()) {
+            return;
+        }
+        DecodeRequest decodedRequest = request;
+        QSharedPointer<QAtomicInt> token = cancelled;
+        Callback done = callback;
+        QMetaObject::invokeMethod(receiver, [decodedRequest, decoded, token, done]() {
+            if (!token->loadAcquire()) {
+                done(decodedRequest, decoded);
+            }
+        }, Qt::QueuedConnection);
+    }
+
+private:
+    static const int previewHeaderBytes = 128 * 1024;
+
+    DecodedImage decodePreview() const {
+        DecodedImage decoded;
+        if (!request.thumbnail.isEmpty()) {
+            decoded.image = uploadableImage(QImage::fromData(request.thumbnail));
+            QImageReader reader(request.path);
+            decoded.sourceSize = reader.size();
+            if (!decoded.sourceSize.isValid()) {
+                decoded.sourceSize = decoded.image.size();
+            }
+            return decoded;
+        }
+        QFile file(request.path);
+        if (!file.open(QIODevice::ReadOnly)) {
+            return decoded;
+        }
+        QByteArray header = file.read(previewHeaderBytes);
+        const uchar* data = reinterpret_cast<const uchar*>(header.constData());
+        int offset = 0;
+        int length = 0;
+        if (exifThumbnailRange(data, header.size(), &offset, &length)) {
+            decoded.image = QImage::fromData(data + offset, length, "JPEG");
+        }
+        if (decoded.image.isNull()) {
+            return decoded;
+        }
+        decoded.image = uploadableImage(decoded.image);
+        QBuffer buffer(&header);
+        buffer.open(QIODevice::ReadOnly);
+        QImageReader reader(&buffer);
+        decoded.sourceSize = reader.size();
+        if (!decoded.sourceSize.isValid()) {
+            decoded.sourceSize = decoded.image.size();
+        }
+        return decoded;
+    }
+
+    DecodedImage decode() const {
+        if (request.preview) {
+            return decodePreview();
+        }
+        DecodedImage decoded;
+        if (!request.compressedRecord.isEmpty()
+            && readCompressedRecord(request.compressedRecord, &decoded.compressed, &decoded.sourceSize)) {
+            return decoded;
+        }
+        if (request.cell && !request.thumbnail.isEmpty()) {
+            decoded.image = QImage::fromData(request.thumbnail);
+            if (!decoded.image.isNull()) {
+                return decoded;
+            }
+        }
+        QFile* file = new QFile(request.path);
+        uchar* mapped = nullptr;
+        if (file->open(QIODevice::ReadOnly) && file->size() > 0 && file->size() <= INT_MAX) {
+            mapped = file->map(0, file->size());
+        }
+        if (!mapped) {
+            delete file;
+            QImageReader reader(request.path);
+            read(reader, &decoded);
+            return decoded;
+        }
+        qint64 size = file->size();
+        decoded.image = mapUncompressedImage(file, mapped, size, &decoded.bottomUp);
+        if (!decoded.image.isNull()) {
+            decoded.sourceSize = decoded.image.size();
+            decoded.mapped = true;
+            return decoded;
+        }
+        if (!request.targetSize.isValid()) {
+            decoded.image = decodeJpegInBands(mapped, size);
+            if (!decoded.image.isNull()) {
+                decoded.image = uploadableImage(decoded.image);
+                decoded.sourceSize = decoded.image.size();
+                delete file;
+                return decoded;
+            }
+        }
+#ifdef GRXIV_TURBOJPEG
+        decoded.image = decodeTurboJpeg(mapped, size, request.targetSize, &decoded.sourceSize);
+        if (!decoded.image.isNull()) {
+            delete file;
+            return decoded;
+        }
+#endif
+        {
+            QByteArray bytes = QByteArray::fromRawData(reinterpret_cast<const char*>(mapped), static_cast<int>(size));
+            QBuffer buffer(&bytes);
+            buffer.open(QIODevice::ReadOnly);
+            QImageReader reader(&buffer);
+            read(reader, &decoded);
+        }
+        delete file;
+        return decoded;
+    }
+
+    void read(QImageReader& reader, DecodedImage* decoded) const {
+        decoded->sourceSize = reader.size();
+        if (request.targetSize.isValid() && decoded->sourceSize.isValid()
+            && (decoded->sourceSize.width() > request.targetSize.width() || decoded->sourceSize.height() > request.targetSize.height())) {
+            reader.setScaledSize(decoded->sourceSize.scaled(request.targetSize, Qt::KeepAspectRatio).expandedTo(QSize(1, 1)));
+        }
+        if (reader.read(&decoded->image)) {
+            decoded->animated = reader.supportsAnimation() && reader.imageCount() > 1;
+            decoded->image = uploadableImage(decoded->image);
+            if (!decoded->sourceSize.isValid()) {
+                decoded->sourceSize = decoded->image.size();
+            }
+        }
+    }
+
+    DecodeRequest request;
+    QSharedPointer<QAtomicInt> cancelled;
+    QObject* receiver;
+    Callback callback;
+};
+
+class ImageLoader {
+public:
+    ImageLoader(QObject* receiver, const DecodeJob::Callback& callback)
+        : receiver(receiver), callback(callback) {}
+
+    ~ImageLoader() {
+        cancelAll();
+        pool.waitForDone();
+    }
+
+    void request(const DecodeRequest& request) {
+        QString id = request.id();
+        if (pending.contains(id)) {
+            return;
+        }
+        PendingDecode job;
+        job.key = request.key;
+        job.cancelled = QSharedPointer<QAtomicInt>(new QAtomicInt(0));
+        pending.insert(id, job);
+        DecodeJob::Callback done = callback;
+        QHash<QString, PendingDecode>* jobs = &pending;
+        pool.start(new DecodeJob(request, job.cancelled, receiver, [jobs, done](const DecodeRequest& decodedRequest, const DecodedImage& decoded) {
+            jobs->remove(decodedRequest.id());
+            done(decodedRequest, decoded);
+        }), request.priority);
+    }
+
+    void cancelExcept(const QSet<QString>& keep) {
+        QHash<QString, PendingDecode>::iterator it = pending.begin();
+        while (it != pending.end()) {
+            if (keep.contains(it->key)) {
+                ++it;
+            } else {
+                it->cancelled->storeRelease(1);
+                it = pending.erase(it);
+            }
+        }
+    }
+
+    void cancelAll() {
+        cancelExcept(QSet<QString>());
+    }
+
+    void waitForDone() {
+        pool.waitForDone();
+    }
+
+private:
+    struct PendingDecode {
+        QString key;
+        QSharedPointer<QAtomicInt> cancelled;
+    };
+
+    QThreadPool pool;
+    QObject* receiver;
+    DecodeJob::Callback callback;
+    QHash<QString, PendingDecode> pending;
+};
+
+struct AnimationFrame {
+    QImage image;
+    int delayMs;
+
+    AnimationFrame() : delayMs(0) {}
+};
+
+// Single-producer, single-consumer ring of decoded frames. The decoder
+// blocks while the ring is full, so long animations never hold more than
+// capacity frames in memory; the GUI thread only ever polls.
+class FrameRing {
+public:
+    explicit FrameRing(int capacity)
+        : frames(capacity), freeSlots(capacity), head(0), tail(0), cancelled(0), finished(0) {}
+
+    bool push(const AnimationFrame& frame) {
+        while (!freeSlots.tryAcquire(1, pollIntervalMs)) {
+            if (cancelled.loadAcquire()) {
+                return false;
+            }
+        }
+        if (cancelled.loadAcquire()) {
+            freeSlots.release();
+            return false;
+        }
+        frames[tail] = frame;
+        tail = (tail + 1) % frames.size();
+        usedSlots.release();
+        return true;
+    }
+
+    bool pop(AnimationFrame* frame) {
+        if (!usedSlots.tryAcquire()) {
+            return false;
+        }
+        *frame = frames[head];
+        frames[head] = AnimationFrame();
+        head = (head + 1) % frames.size();
+        freeSlots.release();
+        return true;
+    }
+
+    void cancel() {
+        cancelled.storeRelease(1);
+    }
+
+    bool isCancelled() const {
+        return cancelled.loadAcquire();
+    }
+
+    void finish() {
+        finished.storeRelease(1);
+    }
+
+    // True once the decoder has stopped and every frame has been taken.
+    bool isDrained() const {
+        return finished.loadAcquire() && usedSlots.available() == 0;
+    }
+
+private:
+    static const int pollIntervalMs = 50;
+
+    QVector<AnimationFrame> frames;
+    QSemaphore freeSlots;
+    QSemaphore usedSlots;
+    int head;
+    int tail;
+    QAtomicInt cancelled;
+    QAtomicInt finished;
+};
+
+class AnimationDecodeJob : public QRunnable {
+public:
+    AnimationDecodeJob(const QString& path, const QSharedPointer<FrameRing>& ring) : path(path), ring(ring) {}
+
+    void run() override {
+        int loops = 0;
+        for (int pass = 0; !ring->isCancelled(); ++pass) {
+            QImageReader reader(path);
+            if (pass == 0) {
+                loops = reader.loopCount();
+            }
+            int frames = 0;
+            QImage frame;
+            while (!ring->isCancelled() && reader.read(&frame)) {
+                AnimationFrame decoded;
+                decoded.image = uploadableImage(frame);
+                // Browsers treat very short GIF delays as the 10 fps default.
+                decoded.delayMs = reader.nextImageDelay() > minimumDelayMs ? reader.nextImageDelay() : defaultDelayMs;
+                if (!ring->push(decoded)) {
+                    return;
+                }
+                ++frames;
+            }
+            if (frames == 0 || (loops >= 0 && pass >= loops)) {
+                break;
+            }
+        }
+        ring->finish();
+    }
+
+private:
+    static const int minimumDelayMs = 10;
+    static const int defaultDelayMs = 100;
+
+    QString path;
+    QSharedPointer<FrameRing> ring;
+};
+
+// Decodes the frames of one animation ahead of playback on its own thread.
+class AnimationPlayer {
+public:
+    AnimationPlayer() {
+        pool.setMaxThreadCount(1);
+    }
+
+    ~AnimationPlayer() {
+        stop();
+        pool.waitForDone();
+    }
+
+    bool isActive() const {
+        return !ring.isNull();
+    }
+
+    void start(const QString& path) {
+        stop();
+        ring = QSharedPointer<FrameRing>(new FrameRing(ringCapacity));
+        pool.start(new AnimationDecodeJob(path, ring));
+    }
+
+    void stop() {
+        if (ring) {
+            ring->cancel();
+            ring.clear();
+        }
+    }
+
+    bool nextFrame(AnimationFrame* frame) {
+        return ring && ring->pop(frame);
+    }
+
+    bool isFinished() const {
+        return !ring || ring->isDrained();
+    }
+
+private:
+    static const int ringCapacity = 8;
+
+    QThreadPool pool;
+    QSharedPointer<FrameRing> ring;
+};
+
+// Finds the length of the first complete image in a stream of concatenated
+// images, for formats that delimit themselves (JPEG/MJPEG, PNG, BMP). It
+// keeps its place between calls, so a frame arriving over many reads is
+// parsed once instead of from its start after every read; reset() whenever
+// bytes are removed from the front of the stream.
+class StreamFrameScanner {
+public:
+    StreamFrameScanner() {
+        reset();
+    }
+
+    void reset() {
+        format = Unknown;
+        pos = 0;
+        entropyCoded = false;
+    }
+
+    // Returns 0 while more bytes are needed and -1 if the data is not one
+    // of the formats.
+    qint64 frameLength(const QByteArray& stream) {
+        const uchar* data = reinterpret_cast<const uchar*>(stream.constData());
+        qint64 size = stream.size();
+        if (format == Unknown) {
+            static const uchar pngSignature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+            if (size < 8) {
+                return 0;
+            }
+            if (data[0] == 0xFF && data[1] == 0xD8) {
+                format = Jpeg;
+                pos = 2;
+            } else if (memcmp(data, pngSignature, sizeof(pngSignature)) == 0) {
+                format = Png;
+                pos = 8;
+            } else if (data[0] == 'B' && data[1] == 'M') {
+                format = Bmp;
+            } else {
+                return -1;
+            }
+        }
+        if (format == Jpeg) {
+            return jpegLength(data, size);
+        }
+        if (format == Png) {
+            return pngLength(data, size);
+        }
+        qint64 length = readInteger(data + 2, false, 4);
+        if (length < 26) {
+            return -1;
+        }
+        return length <= size ? length : 0;
+    }
+
+private:
+    enum Format { Unknown, Jpeg, Png, Bmp };
+
+    qint64 jpegLength(const uchar* data, qint64 size) {
+        for (;;) {
+            if (entropyCoded) {
+                // Entropy-coded data runs until the next marker that is
+                // neither a stuffed 0xFF00 nor a restart marker.
+                for (; pos + 1 < size; ++pos) {
+                    if (data[pos] == 0xFF && data[pos + 1] != 0x00 && data[pos + 1] != 0xFF
+                        && (data[pos + 1] < 0xD0 || data[pos + 1] > 0xD7)) {
+                        break;
+                    }
+                }
+                if (pos + 1 >= size) {
+                    return 0;
+                }
+                entropyCoded = false;
+            }
+            if (pos + 2 > size) {
+                return 0;
+            }
+            if (data[pos] != 0xFF) {
+                return -1;
+            }
+            uchar marker = data[pos + 1];
+            if (marker == 0xFF) {
+                ++pos;
+                continue;
+            }
+            if (marker == 0xD9) {
+                return pos + 2;
+            }
+            if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+                pos += 2;
+                continue;
+            }
+            if (pos + 4 > size) {
+                return 0;
+            }
+            pos += 2 + ((data[pos + 2] << 8) | data[pos + 3]);
+            entropyCoded = marker == 0xDA;
+        }
+    }
+
+    qint64 pngLength(const uchar* data, qint64 size) {
+        while (pos + 8 <= size) {
+            qint64 length = readInteger(data + pos, true, 4);
+            if (memcmp(data + pos + 4, "IEND", 4) == 0) {
+                return pos + 12 + length <= size ? pos + 12 + length : 0;
+            }
+            pos += 12 + length;
+        }
+        return 0;
+    }
+
+    Format format;
+    qint64 pos;
+    bool entropyCoded;
+};
+
+// Holds only the newest undecoded frame; frames replaced before the decoder
+// gets to them are counted as dropped.
+class FrameMailbox {
+public:
+    FrameMailbox() : closed(false), dropped(0) {}
+
+    void put(const QByteArray& frame) {
+        QMutexLocker locker(&mutex);
+        if (!latest.isEmpty()) {
+            ++dropped;
+        }
+        latest = frame;
+        arrived.wakeOne();
+    }
+
+    // Blocks until a frame arrives; false once closed and drained.
+    bool take(QByteArray* frame) {
+        QMutexLocker locker(&mutex);
+        while (latest.isEmpty() && !closed) {
+            arrived.wait(&mutex);
+        }
+        if (latest.isEmpty()) {
+            return false;
+        }
+        *frame = latest;
+        latest.clear();
+        return true;
+    }
+
+    void close() {
+        QMutexLocker locker(&mutex);
+        closed = true;
+        arrived.wakeAll();
+    }
+
+    int droppedFrames() {
+        QMutexLocker locker(&mutex);
+        return dropped;
+    }
+
+private:
+    QMutex mutex;
+    QWaitCondition arrived;
+    QByteArray latest;
+    bool closed;
+    int dropped;
+};
+
+class StreamReadJob : public QRunnable {
+public:
+    StreamReadJob(int descriptor, const QSharedPointer<FrameMailbox>& mailbox, const QSharedPointer<QAtomicInt>& cancelled)
+        : descriptor(descriptor), mailbox(mailbox), cancelled(cancelled) {}
+
+    void run() override {
+        QByteArray buffer;
+        QByteArray chunk(chunkBytes, Qt::Uninitialized);
+        StreamFrameScanner scanner;
+        bool delimited = true;
+        bool synchronized = false;
+        while (!cancelled->loadAcquire()) {
+            pollfd descriptors = { descriptor, POLLIN, 0 };
+            int ready = ::poll(&descriptors, 1, pollIntervalMs);
+            if (ready < 0 && errno != EINTR) {
+                break;
+            }
+            if (ready <= 0) {
+                continue;
+            }
+            ssize_t count = ::read(descriptor, chunk.data(), chunk.size());
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                break;
+            }
+            buffer.append(chunk.constData(), static_cast<int>(count));
+            while (delimited && !buffer.isEmpty()) {
+                qint64 length = scanner.frameLength(buffer);
+                if (length < 0 && synchronized) {
+                    resynchronize(&buffer);
+                    scanner.reset();
+                    if (scanner.frameLength(buffer) < 0) {
+                        break;
+                    }
+                    continue;
+                }
+                if (length < 0) {
+                    delimited = false;
+                } else if (length > 0) {
+                    mailbox->put(buffer.left(static_cast<int>(length)));
+                    buffer.remove(0, static_cast<int>(length));
+                    scanner.reset();
+                    synchronized = true;
+                    continue;
+                }
+                break;
+            }
+        }
+        if (!cancelled->loadAcquire() && !buffer.isEmpty() && (!delimited || !synchronized)) {
+            mailbox->put(buffer);
+        }
+        mailbox->close();
+    }
+
+private:
+    static const int chunkBytes = 256 * 1024;
+    static const int pollIntervalMs = 100;
+
+    // Skips garbage between frames up to the next JPEG or PNG signature,
+    // keeping a short tail in case a signature is split across reads.
+    static void resynchronize(QByteArray* buffer) {
+        int jpeg = buffer->indexOf("\xFF\xD8\xFF", 1);
+        int png = buffer->indexOf("\x89PNG", 1);
+        int next = jpeg < 0 ? png : (png < 0 ? jpeg : qMin(jpeg, png));
+        if (next < 0) {
+            next = qMax(1, buffer->size() - 7);
+        }
+        buffer->remove(0, next);
+    }
+
+    int descriptor;
+    QSharedPointer<FrameMailbox> mailbox;
+    QSharedPointer<QAtomicInt> cancelled;
+};
+
+class StreamDecodeJob : public QRunnable {
+public:
+    typedef std::function<void(const QImage&, bool)> Callback;
+
+    StreamDecodeJob(const QSharedPointer<FrameMailbox>& mailbox, const QSharedPointer<QSemaphore>& displaySlot,
+                    const QSharedPointer<QAtomicInt>& cancelled, QObject* receiver, const Callback& callback)
+        : mailbox(mailbox), displaySlot(displaySlot), cancelled(cancelled), receiver(receiver), callback(callback) {}
+
+    // The slot is taken before picking a frame, so while the GUI thread is
+    // still busy with the previous one newer frames replace older ones in
+    // the mailbox and only the latest is decoded.
+    void run() override {
+        QByteArray data;
+        while (acquireSlot() && mailbox->take(&data)) {
+            QImage frame = uploadableImage(QImage::fromData(data));
+            if (frame.isNull()) {
+                displaySlot->release();
+                continue;
+            }
+            post(frame, false);
+        }
+        if (!cancelled->loadAcquire()) {
+            post(QImage(), true);
+        }
+    }
+
+private:
+    static const int pollIntervalMs = 100;
+
+    bool acquireSlot() {
+        while (!displaySlot->tryAcquire(1, pollIntervalMs)) {
+            if (cancelled->loadAcquire()) {
+                return false;
+            }
+        }
+        return !cancelled->loadAcquire();
+    }
+
+    void post(const QImage& frame, bool finished) {
+        QSharedPointer<QAtomicInt> token = cancelled;
+        QSharedPointer<QSemaphore> slot = finished ? QSharedPointer<QSemaphore>() : displaySlot;
+        Callback done = callback;
+        QMetaObject::invokeMethod(receiver, [frame, finished, token, slot, done]() {
+            if (!token->loadAcquire()) {
+                done(frame, finished);
+            }
+            if (slot) {
+                slot->release();
+            }
+        }, Qt::QueuedConnection);
+    }
+
+    QSharedPointer<FrameMailbox> mailbox;
+    QSharedPointer<QSemaphore> displaySlot;
+    QSharedPointer<QAtomicInt> cancelled;
+    QObject* receiver;
+    Callback callback;
+};
+
+// Shows concatenated images piped to standard input as they arrive.
+class StdinStream {
+public:
+    StdinStream(QObject* receiver, const StreamDecodeJob::Callback& callback)
+        : mailbox(new FrameMailbox()), displaySlot(new QSemaphore(1)), cancelled(new QAtomicInt(0)),
+          receiver(receiver), callback(callback) {
+        pool.setMaxThreadCount(2);
+    }
+
+    ~StdinStream() {
+        cancel();
+    }
+
+    void start() {
+        pool.start(new StreamReadJob(STDIN_FILENO, mailbox, cancelled));
+        pool.start(new StreamDecodeJob(mailbox, displaySlot, cancelled, receiver, callback));
+    }
+
+    void cancel() {
+        cancelled->storeRelease(1);
+        mailbox->close();
+        pool.waitForDone();
+    }
+
+    int droppedFrames() const {
+        return mailbox->droppedFrames();
+    }
+
+private:
+    QThreadPool pool;
+    QSharedPointer<FrameMailbox> mailbox;
+    QSharedPointer<QSemaphore> displaySlot;
+    QSharedPointer<QAtomicInt> cancelled;
+    QObject* receiver;
+    StreamDecodeJob::Callback callback;
+};
+
+// A Deep Zoom Image: an XML descriptor next to a <name>_files directory with
+// one subdirectory per level, from level 0 of a single pixel up to the full
+// resolution, each level halving the next and cut into tiles of tileSize
+// that overlap their neighbours by overlap pixels.
+struct DeepZoomPyramid {
+    QSize size;
+    int tileSize;
+    int overlap;
+    QString format;
+    QString tilesDirectory;
+
+    DeepZoomPyramid() : tileSize(0), overlap(0) {}
+
+    bool isNull() const {
+        return tileSize <= 0 || size.isEmpty();
+    }
+
+    int maxLevel() const {
+        int level = 0;
+        while ((Q_INT64_C(1) << level) < qMax(size.width(), size.height())) {
+            ++level;
+        }
+        return level;
+    }
+
+    QSize levelSize(int level) const {
+        int shift = maxLevel() - level;
+        qint64 scale = Q_INT64_C(1) << shift;
+        return QSize(static_cast<int>((size.width() + scale - 1) >> shift), static_cast<int>((size.height() + scale - 1) >> shift));
+    }
+
+    int columns(int level) const {
+        return (levelSize(level).width() + tileSize - 1) / tileSize;
+    }
+
+    int rows(int level) const {
+        return (levelSize(level).height() + tileSize - 1) / tileSize;
+    }
+
+    // Pixels of the level the tile file holds, overlap included.
+    QRect tileRect(int level, int column, int row) const {
+        QRect core(column * tileSize, row * tileSize, tileSize, tileSize);
+        return core.adjusted(column > 0 ? -overlap : 0, row > 0 ? -overlap : 0, overlap, overlap)
+            .intersected(QRect(QPoint(0, 0), levelSize(level)));
+    }
+
+    // The finest level drawn as a single tile, kept as the backdrop.
+    int baseLevel() const {
+        int level = 0;
+        while (level < maxLevel() && columns(level + 1) == 1 && rows(level + 1) == 1) {
+            ++level;
+        }
+        return level;
+    }
+
+    QString tilePath(int level, int column, int row) const {
+        return QString("%1/%2/%3_%4.%5").arg(tilesDirectory).arg(level).arg(column).arg(row).arg(format);
+    }
+};
+
+static bool isDeepZoomPath(const QString& path) {
+    return path.endsWith(".dzi", Qt::CaseInsensitive);
+}
+
+static QString deepZoomTilesDirectory(const QString& descriptorPath) {
+    QFileInfo descriptor(descriptorPath);
+    return descriptor.absolutePath() + '/' + descriptor.completeBaseName() + "_files";
+}
+
+static DeepZoomPyramid readDeepZoomPyramid(const QString& path) {
+    DeepZoomPyramid pyramid;
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return pyramid;
+    }
+    QXmlStreamReader xml(&file);
+    while (xml.readNextStartElement()) {
+        if (xml.name() == QLatin1String("Image")) {
+            pyramid.tileSize = xml.attributes().value("TileSize").toInt();
+            pyramid.overlap = xml.attributes().value("Overlap").toInt();
+            pyramid.format = xml.attributes().value("Format").toString();
+        } else if (xml.name() == QLatin1String("Size")) {
+            pyramid.size = QSize(xml.attributes().value("Width").toInt(), xml.attributes().value("Height").toInt());
+            xml.skipCurrentElement();
+        } else {
+            xml.skipCurrentElement();
+        }
+    }
+    if (xml.hasError() || pyramid.overlap < 0 || pyramid.format.isEmpty()) {
+        return DeepZoomPyramid();
+    }
+    pyramid.tilesDirectory = deepZoomTilesDirectory(path);
+    return pyramid;
+}
+
+// Pieces region of a level together from its tile files.
+static QImage deepZoomRegion(const DeepZoomPyramid& pyramid, int level, const QRect& region) {
+    QImage assembled(region.size(), QImage::Format_ARGB32);
+    assembled.fill(Qt::transparent);
+    QPainter painter(&assembled);
+    painter.setCompositionMode(QPainter::CompositionMode_Source);
+    int firstColumn = region.left() / pyramid.tileSize;
+    int lastColumn = qMin(pyramid.columns(level) - 1, region.right() / pyramid.tileSize);
+    int firstRow = region.top() / pyramid.tileSize;
+    int lastRow = qMin(pyramid.rows(level) - 1, region.bottom() / pyramid.tileSize);
+    for (int row = firstRow; row <= lastRow; ++row) {
+        for (int column = firstColumn; column <= lastColumn; ++column) {
+            QImage tile(pyramid.tilePath(level, column, row));
+            if (tile.isNull()) {
+                return QImage();
+            }
+            painter.drawImage(pyramid.tileRect(level, column, row).topLeft() - region.topLeft(), tile);
+        }
+    }
+    return assembled;
+}
+
+// Reads an image from top to bottom in bands of whole rows through one open
+// decoder, so writeDeepZoomPyramid() holds a band at a time whatever the
+// size of the source.
+class BandReader {
+public:
+    virtual ~BandReader() {}
+
+    virtual QSize size() const = 0;
+    virtual bool hasAlphaChannel() const = 0;
+    // The next rows rows, all bands in one format; null on error.
+    virtual QImage read(int rows) = 0;
+};
+
+#ifdef GRXIV_LIBJPEG
+struct JpegBandErrors {
+    jpeg_error_mgr manager;
+    jmp_buf jump;
+};
+
+static void jpegBandError(j_common_ptr info) {
+    longjmp(reinterpret_cast<JpegBandErrors*>(info->err)->jump, 1);
+}
+
+// Scanlines through libjpeg. CMYK is left to QImageReader.
+class JpegBandReader : public BandReader {
+public:
+    JpegBandReader() : file(nullptr), created(false) {}
+
+    ~JpegBandReader() {
+        if (created) {
+            jpeg_destroy_decompress(&info);
+        }
+        if (file) {
+            fclose(file);
+        }
+    }
+
+    bool open(const QString& path) {
+        file = fopen(QFile::encodeName(path).constData(), "rb");
+        if (!file) {
+            return false;
+        }
+        info.err = jpeg_std_error(&errors.manager);
+        errors.manager.error_exit = jpegBandError;
+        if (setjmp(errors.jump)) {
+            return false;
+        }
+        jpeg_create_decompress(&info);
+        created = true;
+        jpeg_stdio_src(&info, file);
+        jpeg_read_header(&info, TRUE);
+        if (info.jpeg_color_space == JCS_CMYK || info.jpeg_color_space == JCS_YCCK) {
+            return false;
+        }
+        info.out_color_space = info.num_components == 1 ? JCS_GRAYSCALE : JCS_RGB;
+        jpeg_start_decompress(&info);
+        return true;
+    }
+
+    QSize size() const override {
+        return QSize(info.output_width, info.output_height);
+    }
+
+    bool hasAlphaChannel() const override {
+        return false;
+    }
+
+    QImage read(int rows) override {
+        QImage band(info.output_width, rows, info.output_components == 1 ? QImage::Format_Grayscale8 : QImage::Format_RGB888);
+        if (band.isNull()) {
+            return QImage();
+        }
+        const JDIMENSION first = info.output_scanline;
+        if (setjmp(errors.jump)) {
+            return QImage();
+        }
+        while (info.output_scanline - first < static_cast<JDIMENSION>(rows) && info.output_scanline < info.output_height) {
+            JSAMPROW row = band.scanLine(info.output_scanline - first);
+            jpeg_read_scanlines(&info, &row, 1);
+        }
+        return info.output_scanline - first == static_cast<JDIMENSION>(rows) ? band : QImage();
+    }
+
+private:
+    FILE* file;
+    bool created;
+    jpeg_decompress_struct info;
+    JpegBandErrors errors;
+};
+#endif
+
+#ifdef GRXIV_LIBPNG
+// Rows through libpng, expanded to 8-bit RGB or RGBA. Interlaced files are
+// refused: their last pass touches every row.
+class PngBandReader : public BandReader {
+public:
+    PngBandReader() : file(nullptr), png(nullptr), info(nullptr), alpha(false) {}
+
+    ~PngBandReader() {
+        if (png) {
+            png_destroy_read_struct(&png, info ? &info : nullptr, nullptr);
+        }
+        if (file) {
+            fclose(file);
+        }
+    }
+
+    bool open(const QString& path) {
+        file = fopen(QFile::encodeName(path).constData(), "rb");
+        if (!file) {
+            return false;
+        }
+        png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+        if (!png) {
+            return false;
+        }
+        info = png_create_info_struct(png);
+        if (!info) {
+            return false;
+        }
+        if (setjmp(png_jmpbuf(png))) {
+            return false;
+        }
+        png_init_io(png, file);
+        png_read_info(png, info);
+        if (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE) {
+            return false;
+        }
+        int colorType = png_get_color_type(png, info);
+        alpha = (colorType & PNG_COLOR_MASK_ALPHA) || png_get_valid(png, info, PNG_INFO_tRNS);
+        png_set_expand(png);
+        png_set_strip_16(png);
+        if (!(colorType & PNG_COLOR_MASK_COLOR)) {
+            png_set_gray_to_rgb(png);
+        }
+        png_read_update_info(png, info);
+        imageSize = QSize(png_get_image_width(png, info), png_get_image_height(png, info));
+        return true;
+    }
+
+    QSize size() const override {
+        return imageSize;
+    }
+
+    bool hasAlphaChannel() const override {
+        return alpha;
+    }
+
+    QImage read(int rows) override {
+        QImage band(imageSize.width(), rows, alpha ? QImage::Format_RGBA8888 : QImage::Format_RGB888);
+        if (band.isNull()) {
+            return QImage();
+        }
+        if (setjmp(png_jmpbuf(png))) {
+            return QImage();
+        }
+        for (int y = 0; y < rows; ++y) {
+            png_read_row(png, band.scanLine(y), nullptr);
+        }
+        return band;
+    }
+
+private:
+    FILE* file;
+    png_structp png;
+    png_infop info;
+    QSize imageSize;
+    bool alpha;
+};
+#endif
+
+#ifdef GRXIV_LIBTIFF
+// Rows through libtiff's RGBA interface, which takes every photometric,
+// bit depth and tiled layout and reads only the strips or tiles a band
+// overlaps.
+class TiffBandReader : public BandReader {
+public:
+    TiffBandReader() : tiff(nullptr), begun(false), nextRow(0) {}
+
+    ~TiffBandReader() {
+        if (begun) {
+            TIFFRGBAImageEnd(&image);
+        }
+        if (tiff) {
+            TIFFClose(tiff);
+        }
+    }
+
+    bool open(const QString& path) {
+        tiff = TIFFOpen(QFile::encodeName(path).constData(), "r");
+        char message[1024];
+        if (!tiff || !TIFFRGBAImageOK(tiff, message) || !TIFFRGBAImageBegin(&image, tiff, 0, message)) {
+            return false;
+        }
+        begun = true;
+        image.req_orientation = ORIENTATION_TOPLEFT;
+        return true;
+    }
+
+    QSize size() const override {
+        return QSize(image.width, image.height);
+    }
+
+    bool hasAlphaChannel() const override {
+        return image.alpha != 0;
+    }
+
+    // libtiff packs premultiplied ABGR into native words, which is Qt's
+    // ARGB32 with red and blue swapped.
+    QImage read(int rows) override {
+        QImage band(image.width, rows, QImage::Format_ARGB32_Premultiplied);
+        if (band.isNull()) {
+            return QImage();
+        }
+        image.row_offset = nextRow;
+        image.col_offset = 0;
+        if (!TIFFRGBAImageGet(&image, reinterpret_cast<quint32*>(band.bits()), image.width, rows)) {
+            return QImage();
+        }
+        nextRow += rows;
+        return band.rgbSwapped();
+    }
+
+private:
+    TIFF* tiff;
+    TIFFRGBAImage image;
+    bool begun;
+    int nextRow;
+};
+#endif
+
+// Any other format whose Qt plugin decodes a clip rectangle without the rest
+// of the image. The reader is one-shot, so each band opens the file again
+// and decodes down to the band's last row.
+class ClipBandReader : public BandReader {
+public:
+    ClipBandReader() : alpha(false), nextRow(0) {}
+
+    bool open(const QString& source) {
+        QImageReader reader(source);
+        if (!reader.supportsOption(QImageIOHandler::ClipRect)) {
+            return false;
+        }
+        path = source;
+        imageSize = reader.size();
+        alpha = QImage::toPixelFormat(reader.imageFormat()).alphaUsage() == QPixelFormat::UsesAlpha;
+        return imageSize.isValid();
+    }
+
+    QSize size() const override {
+        return imageSize;
+    }
+
+    bool hasAlphaChannel() const override {
+        return alpha;
+    }
+
+    QImage read(int rows) override {
+        QRect band(0, nextRow, imageSize.width(), rows);
+        QImageReader reader(path);
+        reader.setClipRect(band);
+        QImage image = reader.read();
+        if (image.size() != band.size()) {
+            return QImage();
+        }
+        nextRow += rows;
+        return image.convertToFormat(alpha ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+    }
+
+private:
+    QString path;
+    QSize imageSize;
+    bool alpha;
+    int nextRow;
+};
+
+template <typename Reader>
+static BandReader* tryBandReader(const QString& path) {
+    Reader* reader = new Reader();
+    if (reader->open(path)) {
+        return reader;
+    }
+    delete reader;
+    return nullptr;
+}
+
+// Null, with error set, when the source can only be decoded whole.
+static BandReader* openBandReader(const QString& path, QString* error) {
+    QByteArray format = QImageReader::imageFormat(path);
+    BandReader* reader = nullptr;
+#ifdef GRXIV_LIBJPEG
+    if (!reader && format == "jpeg") {
+        reader = tryBandReader<JpegBandReader>(path);
+    }
+#endif
+#ifdef GRXIV_LIBPNG
+    if (!reader && format == "png") {
+        reader = tryBandReader<PngBandReader>(path);
+    }
+#endif
+#ifdef GRXIV_LIBTIFF
+    if (!reader && format == "tiff") {
+        reader = tryBandReader<TiffBandReader>(path);
+    }
+#endif
+    if (!reader) {
+        reader = tryBandReader<ClipBandReader>(path);
+    }
+    if (!reader) {
+        *error = QString("%1: %2 cannot be decoded in bands (JPEG, non-interlaced PNG and TIFF need grxiv built with libjpeg, libpng and libtiff)")
+            .arg(path).arg(format.isEmpty() ? QString("the format") : QString::fromLatin1(format));
+    }
+    return reader;
+}
+
+// Bytes of full-resolution rows kept per pass in writeDeepZoomPyramid(),
+// bounding its memory whatever the source size.
+static const qint64 pyramidStripBytes = Q_INT64_C(256) << 20;
+
+// Builds a pyramid of source at output. The full-resolution level is cut
+// from strips of the source decoded top to bottom by a BandReader, each
+// strip keeping the overlap rows of the one before, and each coarser level
+// is scaled from the tiles of the one above it; memory stays at about two
+// strips. Tiles are PNG when the source has alpha and JPEG otherwise.
+static bool writeDeepZoomPyramid(const QString& source, const QString& output, QString* error) {
+    QScopedPointer<BandReader> reader(openBandReader(source, error));
+    if (!reader) {
+        return false;
+    }
+    DeepZoomPyramid pyramid;
+    pyramid.size = reader->size();
+    pyramid.tileSize = 254;
+    pyramid.overlap = 1;
+    pyramid.format = reader->hasAlphaChannel() ? "png" : "jpg";
+    pyramid.tilesDirectory = deepZoomTilesDirectory(output);
+    if (pyramid.isNull()) {
+        *error = QString("%1: empty image").arg(source);
+        return false;
+    }
+    int maxLevel = pyramid.maxLevel();
+    for (int level = 0; level <= maxLevel; ++level) {
+        if (!QDir().mkpath(QString("%1/%2").arg(pyramid.tilesDirectory).arg(level))) {
+            *error = QString("%1: cannot create the tile directories").arg(pyramid.tilesDirectory);
+            return false;
+        }
+    }
+
+    QAtomicInt failed(0);
+    int columns = pyramid.columns(maxLevel);
+    int rows = pyramid.rows(maxLevel);
+    int stripRows = static_cast<int>(qBound<qint64>(1, pyramidStripBytes / (Q_INT64_C(4) * pyramid.size.width() * pyramid.tileSize), rows));
+    QImage strip;
+    int decodedRows = 0;
+    for (int firstRow = 0; firstRow < rows && !failed.loadAcquire(); firstRow += stripRows) {
+        int lastRow = qMin(rows, firstRow + stripRows) - 1;
+        QRect needed = pyramid.tileRect(maxLevel, 0, firstRow).united(pyramid.tileRect(maxLevel, columns - 1, lastRow));
+        QImage band = reader->read(needed.bottom() + 1 - decodedRows);
+        if (band.isNull()) {
+            *error = QString("%1: decoding failed at row %2").arg(source).arg(decodedRows);
+            return false;
+        }
+        QImage image(needed.size(), band.format());
+        if (image.isNull()) {
+            *error = QString("%1: out of memory").arg(source);
+            return false;
+        }
+        int kept = decodedRows - needed.top();
+        int rowBytes = image.width() * image.depth() / 8;
+        for (int y = 0; y < kept; ++y) {
+            memcpy(image.scanLine(y), strip.constScanLine(strip.height() - kept + y), rowBytes);
+        }
+        for (int y = 0; y < band.height(); ++y) {
+            memcpy(image.scanLine(kept + y), band.constScanLine(y), rowBytes);
+        }
+        band = QImage();
+        strip = image;
+        decodedRows = needed.bottom() + 1;
+        int count = (lastRow - firstRow + 1) * columns;
+        parallelFor(count, [&](int i) {
+            int column = i % columns;
+            int row = firstRow + i / columns;
+            QRect tile = pyramid.tileRect(maxLevel, column, row);
+            if (!strip.copy(tile.translated(-needed.topLeft())).save(pyramid.tilePath(maxLevel, column, row), nullptr, 90)) {
+                failed.storeRelease(1);
+            }
+        });
+    }
+    for (int level = maxLevel - 1; level >= 0 && !failed.loadAcquire(); --level) {
+        int levelColumns = pyramid.columns(level);
+        QRect finerBounds(QPoint(0, 0), pyramid.levelSize(level + 1));
+        parallelFor(levelColumns * pyramid.rows(level), [&](int i) {
+            int column = i % levelColumns;
+            int row = i / levelColumns;
+            QRect tile = pyramid.tileRect(level, column, row);
+            QRect finer = QRect(tile.topLeft() * 2, tile.size() * 2).intersected(finerBounds);
+            QImage region = deepZoomRegion(pyramid, level + 1, finer);
+            if (region.isNull()
+                || !region.scaled(tile.size(), Qt::IgnoreAspectRatio, Qt::SmoothTransformation).save(pyramid.tilePath(level, column, row), nullptr, 90)) {
+                failed.storeRelease(1);
+            }
+        });
+    }
+    if (failed.loadAcquire()) {
+        *error = QString("%1: cannot write the tiles").arg(pyramid.tilesDirectory);
+        return false;
+    }
+
+    QFile file(output);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        *error = QString("%1: %2").arg(output, file.errorString());
+        return false;
+    }
+    QXmlStreamWriter xml(&file);
+    xml.setAutoFormatting(true);
+    xml.writeStartDocument();
+    xml.writeStartElement("Image");
+    xml.writeDefaultNamespace("http://schemas.microsoft.com/deepzoom/2008");
+    xml.writeAttribute("TileSize", QString::number(pyramid.tileSize));
+    xml.writeAttribute("Overlap", QString::number(pyramid.overlap));
+    xml.writeAttribute("Format", pyramid.format);
+    xml.writeEmptyElement("Size");
+    xml.writeAttribute("Width", QString::number(pyramid.size.width()));
+    xml.writeAttribute("Height", QString::number(pyramid.size.height()));
+    xml.writeEndElement();
+    xml.writeEndDocument();
+    return file.flush();
+}
+
+class TiledTexture {
+public:
+    static const int tileSize = 1024;
+
+    TiledTexture() : bottomUp(false), frame(0), totalBytes(0) {}
+
+    ~TiledTexture() {
+        clear();
+    }
+
+    bool isActive() const {
+        return !source.isNull();
+    }
+
+    qint64 bytes() const {
+        return totalBytes;
+    }
+
+    const QString& key() const {
+        return sourceKey;
+    }
+
+    const QImage& image() const {
+        return source;
+    }
+
+    bool isBottomUp() const {
+        return bottomUp;
+    }
+
+    int columns() const {
+        return (source.width() + tileSize - 1) / tileSize;
+    }
+
+    int rows() const {
+        return (source.height() + tileSize - 1) / tileSize;
+    }
+
+    QRect tileRect(int column, int row) const {
+        return QRect(column * tileSize, row * tileSize, tileSize, tileSize).intersected(source.rect());
+    }
+
+    void reset(const QString& key, const QImage& image, bool imageBottomUp) {
+        clear();
+        sourceKey = key;
+        source = image;
+        bottomUp = imageBottomUp;
+    }
+
+    void clear() {
+        for (QHash<int, Tile>::iterator it = tiles.begin(); it != tiles.end(); ++it) {
+            delete it->texture;
+        }
+        tiles.clear();
+        totalBytes = 0;
+        source = QImage();
+        sourceKey.clear();
+    }
+
+    void beginFrame() {
+        ++frame;
+    }
+
+    QOpenGLTexture* tile(int column, int row) {
+        QHash<int, Tile>::iterator it = tiles.find(row * columns() + column);
+        if (it == tiles.end()) {
+            return nullptr;
+        }
+        it->lastUsed = frame;
+        return it->texture;
+    }
+
+    void insert(int column, int row, QOpenGLTexture* texture) {
+        Tile entry;
+        entry.texture = texture;
+        entry.lastUsed = frame;
+        entry.bytes = textureBytes(texture);
+        tiles.insert(row * columns() + column, entry);
+        totalBytes += entry.bytes;
+    }
+
+    void evict(qint64 maxBytes) {
+        while (totalBytes > maxBytes) {
+            QHash<int, Tile>::iterator oldest = tiles.end();
+            for (QHash<int, Tile>::iterator it = tiles.begin(); it != tiles.end(); ++it) {
+                if (it->lastUsed != frame && (oldest == tiles.end() || it->lastUsed < oldest->lastUsed)) {
+                    oldest = it;
+                }
+            }
+            if (oldest == tiles.end()) {
+                return;
+            }
+            totalBytes -= oldest->bytes;
+            delete oldest->texture;
+            tiles.erase(oldest);
+        }
+    }
+
+private:
+    struct Tile {
+        QOpenGLTexture* texture;
+        quint64 lastUsed;
+        qint64 bytes;
+    };
+
+    QString sourceKey;
+    QImage source;
+    bool bottomUp;
+    QHash<int, Tile> tiles;
+    quint64 frame;
+    qint64 totalBytes;
+};
+
+// Thumbnails of the grid view, packed into a few large textures. Slots are
+// recycled least-recently-drawn first, so the grid holds at most
+// atlasCount * slotsPerAtlas thumbnails in video memory and none in RAM.
+class ThumbnailAtlas {
+public:
+    static const int atlasCount = 4;
+    static const int atlasSize = 2048;
+    static const int slotsPerRow = atlasSize / gridSlotSize;
+    static const int slotsPerAtlas = slotsPerRow * slotsPerRow;
+
+    struct Slot {
+        QString key;
+        int atlas;
+        QPoint origin;
+        QSize size;
+        quint64 lastUsed;
+    };
+
+    ThumbnailAtlas() : frame(0) {}
+
+    ~ThumbnailAtlas() {
+        destroy();
+    }
+
+    bool isCreated() const {
+        return !textures.isEmpty();
+    }
+
+    bool create() {
+        for (int i = 0; i < atlasCount; ++i) {
+            QOpenGLTexture* atlas = new QOpenGLTexture(QOpenGLTexture::Target2D);
+            atlas->setSize(atlasSize, atlasSize);
+            atlas->setFormat(QOpenGLTexture::RGBA8_UNorm);
+            atlas->setMipLevels(1);
+            atlas->allocateStorage();
+            if (!atlas->isStorageAllocated()) {
+                delete atlas;
+                destroy();
+                return false;
+            }
+            atlas->setMinMagFilters(QOpenGLTexture::Linear, QOpenGLTexture::Linear);
+            atlas->setWrapMode(QOpenGLTexture::ClampToEdge);
+            textures.append(atlas);
+        }
+        slots.resize(atlasCount * slotsPerAtlas);
+        for (int i = 0; i < slots.size(); ++i) {
+            Slot& slot = slots[i];
+            slot.atlas = i / slotsPerAtlas;
+            slot.origin = QPoint((i % slotsPerRow) * gridSlotSize, (i % slotsPerAtlas / slotsPerRow) * gridSlotSize);
+            slot.lastUsed = 0;
+        }
+        return true;
+    }
+
+    void destroy() {
+        qDeleteAll(textures);
+        textures.clear();
+        slots.clear();
+        slotByKey.clear();
+    }
+
+    QOpenGLTexture* texture(int atlas) const {
+        return textures[atlas];
+    }
+
+    bool contains(const QString& key) const {
+        return slotByKey.contains(key);
+    }
+
+    void beginFrame() {
+        ++frame;
+    }
+
+    const Slot* find(const QString& key) {
+        QHash<QString, int>::const_iterator it = slotByKey.find(key);
+        if (it == slotByKey.end()) {
+            return nullptr;
+        }
+        slots[*it].lastUsed = frame;
+        return &slots[*it];
+    }
+
+    // Returns a slot for key, evicting the thumbnail drawn longest ago, or
+    // nullptr when every slot was drawn in the current frame.
+    Slot* allocate(const QString& key, const QSize& size) {
+        int chosen = -1;
+        for (int i = 0; i < slots.size(); ++i) {
+            if (slots[i].key.isEmpty()) {
+                chosen = i;
+                break;
+            }
+            if (slots[i].lastUsed != frame && (chosen < 0 || slots[i].lastUsed < slots[chosen].lastUsed)) {
+                chosen = i;
+            }
+        }
+        if (chosen < 0) {
+            return nullptr;
+        }
+        Slot& slot = slots[chosen];
+        slotByKey.remove(slot.key);
+        slot.key = key;
+        slot.size = size;
+        slot.lastUsed = frame;
+        slotByKey.insert(key, chosen);
+        return &slot;
+    }
+
+private:
+    QList<QOpenGLTexture*> textures;
+    QVector<Slot> slots;
+    QHash<QString, int> slotByKey;
+    quint64 frame;
+};
+
+struct GridInstance {
+    GLfloat cellRect[4];
+    GLfloat atlasRect[4];
+    GLfloat atlasIndex;
+};
+
+struct GridVertex {
+    GLfloat corner[2];
+    GridInstance instance;
+};
+
+struct PendingUpload {
+    QString key;
+    QImage image;
+    QOpenGLTexture* texture;
+    int nextRow;
+    bool cacheable;
+    bool bottomUp;
+    bool mipmapped;
+    QElapsedTimer queued;
+};
+
+struct UploadedFrame {
+    QOpenGLTexture* texture;
+    int delayMs;
+};
+
+struct QuadUniforms {
+    QRectF rect;
+    QSize textureSize;
+    qreal minification;
+    bool grayscale;
+    bool mipmapped;
+
+    QuadUniforms() : minification(0.0), grayscale(false), mipmapped(false) {}
+
+    bool operator==(const QuadUniforms& other) const {
+        return rect == other.rect && textureSize == other.textureSize && minification == other.minification
+            && grayscale == other.grayscale && mipmapped == other.mipmapped;
+    }
+
+    bool operator!=(const QuadUniforms& other) const {
+        return !(*this == other);
+    }
+};
+
+struct HudStatistics {
+    double cpuFrameMs;
+    double gpuFrameMs;
+    double decodeMs;
+    double uploadMs;
+    int textureHits;
+    int imageHits;
+    int misses;
+
+    HudStatistics()
+        : cpuFrameMs(0.0), gpuFrameMs(-1.0), decodeMs(0.0), uploadMs(0.0), textureHits(0), imageHits(0), misses(0) {}
+};
+
+static int cacheCost(qint64 bytes) {
+    return static_cast<int>(qBound<qint64>(1, bytes >> 10, INT_MAX));
+}
+
+static int imageCost(const QImage& decoded) {
+    return cacheCost(decoded.sizeInBytes());
+}
+
+static int decodedWidth(const DecodedImage& decoded) {
+    return decoded.compressed.isNull() ? decoded.image.width() : decoded.compressed.size.width();
+}
+
+static QByteArray readSystemFile(const QString& path) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QByteArray();
+    }
+    return file.read(4096);
+}
+
+// How short of memory the machine and grxiv's cgroup are, as reported by the
+// kernel on Linux; no pressure elsewhere.
+struct MemoryPressure {
+    // Share of the last ten seconds some task stalled on memory (PSI).
+    double stalledPercent;
+    // Room left under the cgroup v2 memory.max, negative when over it.
+    qint64 cgroupHeadroom;
+    bool cgroupLimited;
+
+    MemoryPressure() : stalledPercent(0.0), cgroupHeadroom(0), cgroupLimited(false) {}
+};
+
+static MemoryPressure readMemoryPressure() {
+    MemoryPressure pressure;
+    // some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+    for (const QByteArray& line : readSystemFile("/proc/pressure/memory").split('\n')) {
+        if (!line.startsWith("some ")) {
+            continue;
+        }
+        for (const QByteArray& field : line.split(' ')) {
+            if (field.startsWith("avg10=")) {
+                pressure.stalledPercent = field.mid(6).toDouble();
+            }
+        }
+    }
+    // 0::/user.slice/user-1000.slice/session-2.scope
+    for (const QByteArray& line : readSystemFile("/proc/self/cgroup").split('\n')) {
+        if (!line.startsWith("0::")) {
+            continue;
+        }
+        QString directory = "/sys/fs/cgroup" + QString::fromLocal8Bit(line.mid(3));
+        bool limitOk = false;
+        bool currentOk = false;
+        qint64 limit = readSystemFile(directory + "/memory.max").trimmed().toLongLong(&limitOk);
+        qint64 current = readSystemFile(directory + "/memory.current").trimmed().toLongLong(&currentOk);
+        if (limitOk && currentOk) {
+            pressure.cgroupLimited = true;
+            pressure.cgroupHeadroom = limit - current;
+        }
+    }
+    return pressure;
+}
+
+// PSI stall shares at which the cache budgets are halved and quartered.
+static const double memoryStallPercent = 1.0;
+static const double severeMemoryStallPercent = 10.0;
+// Room kept free under a cgroup limit, so grxiv is not what hits it.
+static const qint64 cgroupReserveBytes = Q_INT64_C(64) << 20;
+static const int memoryPressureIntervalMs = 2000;
+
+// Sizes past which the thumbnail and compressed texture packs are compacted.
+static const qint64 thumbnailStoreBytes = Q_INT64_C(256) << 20;
+static const qint64 compressedStoreBytes = Q_INT64_C(1) << 30;
+
+// Compressed textures are decoded into a power-of-two box at least as large
+// as the window, so resizing the window or moving it to another screen
+// reuses the stored blocks rather than storing another set.
+static int compressedTextureLevel(const QSize& targetSize) {
+    int level = 0;
+    while ((1 << level) < qMax(targetSize.width(), targetSize.height()) && level < 30) {
+        ++level;
+    }
+    return level;
+}
+
+// Makes the global share context current on an offscreen surface for the
+// lifetime of the scope, then restores the caller's context. Qt's GL
+// wrappers keep calling through the functions of the context that created
+// them, and textures and programs can outlive the window that created them
+// (e.g. one opened with N), so they are created in the application-lifetime
+// share context. Without a share context the caller's stays current and the
+// objects are created there.
+class ShareContextScope {
+public:
+    explicit ShareContextScope(QOffscreenSurface* surface)
+        : previous(QOpenGLContext::currentContext()), previousSurface(previous ? previous->surface() : nullptr),
+          shared(false) {
+        QOpenGLContext* share = QOpenGLContext::globalShareContext();
+        if (share && share != previous && surface->isValid()) {
+            shared = share->makeCurrent(surface);
+            if (!shared && previous) {
+                previous->makeCurrent(previousSurface);
+            }
+        }
+    }
+
+    ~ShareContextScope() {
+        if (shared) {
+            // Other contexts see the new objects once the commands creating
+            // them have been flushed.
+            QOpenGLContext::currentContext()->functions()->glFlush();
+            if (previous) {
+                previous->makeCurrent(previousSurface);
+            } else {
+                QOpenGLContext::globalShareContext()->doneCurrent();
+            }
+        }
+    }
+
+private:
+    Q_DISABLE_COPY(ShareContextScope)
+
+    QOpenGLContext* previous;
+    QSurface* previousSurface;
+    bool shared;
+};
+
+// Everything the viewer windows of one process share: the decode pool and
+// its caches, the thumbnail store and, since every window's context is in
+// one share group (Qt::AA_ShareOpenGLContexts), the texture cache and the
+// programs and buffers all windows draw with. The first window to
+// initialise GL creates those objects and the last one destroys them, both
+// with the global share context current (ShareContextScope).
+class ViewerSession : public QObject, public QEnableSharedFromThis<ViewerSession> {
+public:
+    typedef std::function<void(QOpenGLTexture*, QOpenGLTexture*)> ReplacementHandler;
+    typedef std::function<void(const QString&, QWidget*)> WindowOpener;
+    typedef std::function<QHash<QString, int>()> DistanceProvider;
+    typedef std::function<void()> TrimHandler;
+    typedef std::function<qint64()> TextureBytes;
+
+    explicit ViewerSession(const ViewerOptions& options)
+        : options(options), imageCache(cacheCost(options.ramCacheBytes)),
+          textureCache(options.vramCacheBytes, [this](QOpenGLTexture* evicted) { recycleTexture(evicted); }),
+          thumbnails(options.thumbnailStorePath, thumbnailStoreBytes),
+          compressedTextures(options.compressedStorePath, compressedStoreBytes), readahead(options.ioDepth),
+          shaderProgram(nullptr), gridProgram(nullptr), differenceProgram(nullptr), VBO(0), EBO(0), gridCornerBuffer(QOpenGLBuffer::VertexBuffer), glUsers(0),
+          budgetScale(1.0),
+          loader(this, [this](const DecodeRequest& request, const DecodedImage& decoded) { imageDecoded(request, decoded); }) {
+        textureCache.setReserved([this]() { return vramBytes() - textureCache.bytes(); });
+        if (QOpenGLContext* share = QOpenGLContext::globalShareContext()) {
+            shareSurface.setFormat(share->format());
+            shareSurface.create();
+        }
+        if (options.watchMemoryPressure) {
+            QObject::connect(&pressureTimer, &QTimer::timeout, [this]() { checkMemoryPressure(); });
+            pressureTimer.start(memoryPressureIntervalMs);
+        }
+    }
+
+    void addView(QObject* view, const DecodeJob::Callback& decoded, const ReplacementHandler& replaced,
+                 const DistanceProvider& distances, const TrimHandler& trim, const TextureBytes& textureBytes) {
+        View entry;
+        entry.decoded = decoded;
+        entry.replaced = replaced;
+        entry.distances = distances;
+        entry.trim = trim;
+        entry.textureBytes = textureBytes;
+        views.insert(view, entry);
+    }
+
+    void removeView(QObject* view) {
+        views.remove(view);
+        retain(view, QSet<QString>());
+    }
+
+    // Decode jobs run once for all windows; keys no window still wants are
+    // cancelled.
+    void retain(QObject* view, const QSet<QString>& keys) {
+        if (keys.isEmpty()) {
+            retained.remove(view);
+        } else {
+            retained.insert(view, keys);
+        }
+        QSet<QString> wanted;
+        for (const QSet<QString>& viewKeys : retained) {
+            wanted.unite(viewKeys);
+        }
+        loader.cancelExcept(wanted);
+    }
+
+    QOpenGLTexture* acquireTexture(const QSize& size, QOpenGLTexture::TextureFormat format, bool mipmapped) {
+        for (int i = 0; i < recycledTextures.size(); ++i) {
+            QOpenGLTexture* recycled = recycledTextures[i];
+            if (recycled->width() == size.width() && recycled->height() == size.height() && recycled->format() == format
+                && (recycled->mipLevels() > 1) == mipmapped) {
+                return recycledTextures.takeAt(i);
+            }
+        }
+        ShareContextScope scope(&shareSurface);
+        QOpenGLTexture* created = new QOpenGLTexture(QOpenGLTexture::Target2D);
+        created->setSize(size.width(), size.height());
+        created->setFormat(format);
+        created->setMipLevels(mipmapped ? created->maximumMipLevels() : 1);
+        created->allocateStorage();
+        if (!created->isStorageAllocated()) {
+            delete created;
+            return nullptr;
+        }
+        created->setMinificationFilter(mipmapped ? QOpenGLTexture::LinearMipMapLinear : QOpenGLTexture::Linear);
+        created->setMagnificationFilter(QOpenGLTexture::Linear);
+        return created;
+    }
+
+    void recycleTexture(QOpenGLTexture* unused) {
+        if (!unused) {
+            return;
+        }
+        recycledTextures.prepend(unused);
+        while (recycledTextures.size() > maxRecycledTextures) {
+            delete recycledTextures.takeLast();
+        }
+    }
+
+    // A cached texture was superseded (a sharper decode of the same image);
+    // windows still drawing the old one switch before it is recycled.
+    // replacement is null when it is not cached and so not shareable.
+    void replaceTexture(QOpenGLTexture* replaced, QOpenGLTexture* replacement) {
+        if (!replaced) {
+            return;
+        }
+        for (const View& view : views) {
+            view.replaced(replaced, replacement);
+        }
+        recycleTexture(replaced);
+    }
+
+    // The configured budgets, shrunk while the system is short of memory.
+    qint64 ramBudgetBytes() const {
+        return static_cast<qint64>(options.ramCacheBytes * budgetScale);
+    }
+
+    qint64 vramBudgetBytes() const {
+        return static_cast<qint64>(options.vramCacheBytes * budgetScale);
+    }
+
+    qint64 ramBytes() const {
+        return static_cast<qint64>(imageCache.totalCost()) << 10;
+    }
+
+    // All video memory the windows hold, charged against the one budget:
+    // the shared cache and recycled textures, and each window's tiles,
+    // pyramid tiles, uncached and in-flight textures.
+    qint64 vramBytes() const {
+        qint64 bytes = textureCache.bytes();
+        for (const QOpenGLTexture* recycled : recycledTextures) {
+            bytes += textureBytes(recycled);
+        }
+        for (const View& view : views) {
+            bytes += view.textureBytes();
+        }
+        return bytes;
+    }
+
+    // Makes room in the budget for bytes more of a window's own textures by
+    // evicting cached ones, farthest from every window's current image
+    // first; returns the room left, negative when pinned textures leave too
+    // little and the window must give up some of its own. A context must
+    // be current.
+    qint64 reserveVram(qint64 bytes) {
+        evictTextures(vramBudgetBytes() - vramBytes() + textureCache.bytes() - bytes);
+        return vramBudgetBytes() - vramBytes();
+    }
+
+    // After the budget shrank. A context must be current.
+    void trimTextures() {
+        if (budgetScale < 1.0) {
+            qDeleteAll(recycledTextures);
+            recycledTextures.clear();
+        }
+        textureCache.setMaxBytes(vramBudgetBytes());
+        evictTextures(vramBudgetBytes() - vramBytes() + textureCache.bytes());
+    }
+
+    ViewerOptions options;
+    QCache<QString, DecodedImage> imageCache;
+    QHash<QString, QSize> sourceSizes;
+    QSet<QString> animatedKeys;
+    QList<QOpenGLTexture*> recycledTextures;
+    TextureCache textureCache;
+    ThumbnailStore thumbnails;
+    ThumbnailStore compressedTextures;
+    FileReadahead readahead;
+    QOpenGLShaderProgram* shaderProgram;
+    QOpenGLShaderProgram* gridProgram;
+    QOpenGLShaderProgram* differenceProgram;
+    GLuint VBO, EBO;
+    QOpenGLBuffer gridCornerBuffer;
+    // Uniforms last written to shaderProgram, by whichever window drew.
+    QuadUniforms quadUniforms;
+    int glUsers;
+    QOffscreenSurface shareSurface;
+    WindowOpener openWindow;
+
+private:
+    struct View {
+        DecodeJob::Callback decoded;
+        ReplacementHandler replaced;
+        DistanceProvider distances;
+        TrimHandler trim;
+        TextureBytes textureBytes;
+    };
+
+    static const int maxRecycledTextures = 2;
+
+    // Under pressure the budgets drop at once; afterwards they grow back by
+    // doubling each check, so a passing spike does not refill the caches in
+    // one go straight into the next one.
+    void checkMemoryPressure() {
+        MemoryPressure pressure = readMemoryPressure();
+        double scale = 1.0;
+        if (pressure.stalledPercent >= severeMemoryStallPercent) {
+            scale = 0.25;
+        } else if (pressure.stalledPercent >= memoryStallPercent) {
+            scale = 0.5;
+        }
+        if (pressure.cgroupLimited && pressure.cgroupHeadroom < cgroupReserveBytes) {
+            qint64 allowed = qMax<qint64>(0, ramBytes() - (cgroupReserveBytes - pressure.cgroupHeadroom));
+            scale = qMin(scale, static_cast<double>(allowed) / qMax<qint64>(1, options.ramCacheBytes));
+        }
+        if (scale > budgetScale) {
+            scale = qMin(scale, qMax(budgetScale * 2.0, 0.125));
+        }
+        if (scale == budgetScale) {
+            return;
+        }
+        budgetScale = scale;
+        trim();
+    }
+
+    // Decoded images go first that no window has near its current one,
+    // then the farthest from it; what a window shows is kept.
+    void trim() {
+        qint64 limit = ramBudgetBytes();
+        QList<QString> keys = imageCache.keys();
+        QHash<QString, int> distances = sortFarthestFirst(&keys);
+        for (const QString& key : keys) {
+            if (ramBytes() <= limit) {
+                break;
+            }
+            if (distances.value(key, INT_MAX) > 0) {
+                imageCache.remove(key);
+            }
+        }
+        imageCache.setMaxCost(cacheCost(limit));
+        QList<TrimHandler> handlers;
+        for (const View& view : views) {
+            handlers.append(view.trim);
+        }
+        for (const TrimHandler& handler : handlers) {
+            handler();
+        }
+    }
+
+    void evictTextures(qint64 limit) {
+        if (textureCache.bytes() <= limit) {
+            return;
+        }
+        QList<QString> keys = textureCache.keys();
+        sortFarthestFirst(&keys);
+        for (const QString& key : keys) {
+            if (textureCache.bytes() <= limit) {
+                break;
+            }
+            if (!textureCache.isPinned(key)) {
+                delete textureCache.take(key);
+            }
+        }
+    }
+
+    // Stable, so keys at the same distance keep their recency order.
+    QHash<QString, int> sortFarthestFirst(QList<QString>* keys) const {
+        QHash<QString, int> distances;
+        for (const View& view : views) {
+            QHash<QString, int> viewDistances = view.distances();
+            for (QHash<QString, int>::const_iterator it = viewDistances.constBegin(); it != viewDistances.constEnd(); ++it) {
+                if (!distances.contains(it.key()) || it.value() < distances.value(it.key())) {
+                    distances.insert(it.key(), it.value());
+                }
+            }
+        }
+        std::stable_sort(keys->begin(), keys->end(), [&distances](const QString& a, const QString& b) {
+            return distances.value(a, INT_MAX) > distances.value(b, INT_MAX);
+        });
+        return distances;
+    }
+
+    // Results land in the shared caches once, then go to every window,
+    // each of which shows what it is currently waiting for.
+    void imageDecoded(const DecodeRequest& request, const DecodedImage& decoded) {
+        if (!decoded.thumbnail.isEmpty()) {
+            thumbnails.insert(request.thumbnailKey, decoded.thumbnail);
+        }
+        if (!decoded.compressedRecord.isEmpty()) {
+            compressedTextures.insert(request.compressedKey, decoded.compressedRecord);
+        }
+        if (request.preview) {
+            if (!decoded.image.isNull() && !sourceSizes.contains(request.key)) {
+                sourceSizes.insert(request.key, decoded.sourceSize);
+            }
+        } else if (!request.cell && (!decoded.image.isNull() || !decoded.compressed.isNull())) {
+            sourceSizes.insert(request.key, decoded.sourceSize);
+            if (decoded.animated) {
+                animatedKeys.insert(request.key);
+            }
+            DecodedImage* cached = imageCache.object(request.key);
+            if (!cached || decodedWidth(*cached) < decodedWidth(decoded)) {
+                DecodedImage* entry = new DecodedImage(decoded);
+                entry->compressedRecord.clear();
+                if (entry->mapped) {
+                    entry->image = decoded.image.copy();
+                    entry->mapped = false;
+                }
+                imageCache.insert(request.key, entry, decoded.compressed.isNull() ? imageCost(decoded.image) : cacheCost(decoded.compressed.blocks.size()));
+            }
+        }
+        QList<DecodeJob::Callback> handlers;
+        for (const View& view : views) {
+            handlers.append(view.decoded);
+        }
+        for (const DecodeJob::Callback& handler : handlers) {
+            handler(request, decoded);
+        }
+    }
+
+    QHash<QObject*, View> views;
+    QHash<QObject*, QSet<QString>> retained;
+    // Fraction of the configured budgets currently granted.
+    double budgetScale;
+    QTimer pressureTimer;
+    // Last, so pending jobs are cancelled before the caches go away.
+    ImageLoader loader;
+
+    friend class ImageGLWidget;
+};
 
 class ImageGLWidget : public QOpenGLWidget, protected QOpenGLFunctions {
     Q_OBJECT
 public:
-    ImageGLWidget(const QString& path, QWidget* parent = nullptr)
-        : QOpenGLWidget(parent), shaderProgram(nullptr), texture(nullptr), zoomLevel(1.0f), currentImageIndex(-1) {
-        QSurfaceFormat format;
-        format.setVersion(2, 1);
-        format.setProfile(QSurfaceFormat::CompatibilityProfile);
-        setFormat(format);
-        setFocusPolicy(Qt::StrongFocus);
+    ImageGLWidget(const QString& path, const QSharedPointer<ViewerSession>& session, QWidget* parent = nullptr)
+        : ImageGLWidget(session, false, parent) {
+        currentImageIndex = -1;
+        opened = openPath(path);
+    }
+
+    ImageGLWidget(const QImage& clipboardImage, const QSharedPointer<ViewerSession>& session, QWidget* parent = nullptr)
+        : ImageGLWidget(session, false, parent) {
+        image = clipboardImage;
+        if (image.isNull()) {
+            opened = false;
+            return;
+        }
+        ImageEntry entry;
+        entry.name = "clipboard_image";
+        entry.modified = 0;
+        entry.size = 0;
+        imageFiles.append(entry);
+        currentKey = "clipboard_image";
+        sourceSizes.insert(currentKey, image.size());
+    }
+
+    // Shows the images piped into stdin as they complete.
+    explicit ImageGLWidget(const QSharedPointer<ViewerSession>& session, QWidget* parent = nullptr)
+        : ImageGLWidget(session, true, parent) {
+        ImageEntry entry;
+        entry.name = "stdin";
+        entry.modified = 0;
+        entry.size = 0;
+        imageFiles.append(entry);
+        currentKey = "stdin";
+        stream.start();
+    }
+
+    ~ImageGLWidget() {
+        stream.cancel();
+        scanner.cancel();
+        session->removeView(this);
+        stopAnimation();
+        makeCurrent();
+        pinDisplayed(QString());
+        closeCompare();
+        for (int i = 0; i < uploads.size(); ++i) {
+            delete uploads[i].texture;
+        }
+        tiledTexture.clear();
+        tileLoader.cancelAll();
+        pyramidTiles.clear();
+        delete uncachedTexture;
+        for (int i = 0; i < pixelBufferCount; ++i) {
+            pixelBuffers[i].destroy();
+        }
+#ifndef QT_OPENGL_ES_2
+        qDeleteAll(timerQueries);
+#endif
+        vertexArray.destroy();
+        thumbnailAtlas.destroy();
+        gridBuffer.destroy();
+        if (sharesGL && --session->glUsers == 0) {
+            destroySharedGL();
+        }
+        doneCurrent();
+    }
+
+protected:
+    void initializeGL() override {
+        if (!context()) {
+            return;
+        }
+
+        initializeOpenGLFunctions();
+
+        sharesGL = true;
+        if (session->glUsers++ == 0) {
+            createSharedGL();
+        }
+        if (!shaderProgram || !shaderProgram->isLinked() || VBO == 0 || EBO == 0) {
+            return;
+        }
+        positionLocation = shaderProgram->attributeLocation("position");
+        texCoordLocation = shaderProgram->attributeLocation("texCoord");
+        mvpLocation = shaderProgram->uniformLocation("mvp");
+        grayscaleLocation = shaderProgram->uniformLocation("grayscale");
+        downscaleLocation = shaderProgram->uniformLocation("downscale");
+        texelSizeLocation = shaderProgram->uniformLocation("texelSize");
+        scaleLocation = shaderProgram->uniformLocation("scale");
+
+        // Vertex array objects are not shared between contexts, so each
+        // window records its own over the shared buffers.
+        if (vertexArray.create()) {
+            vertexArray.bind();
+            bindQuadAttributes();
+            vertexArray.release();
+        }
+
+        if (gridProgram->isLinked()) {
+            gridCornerLocation = gridProgram->attributeLocation("corner");
+            gridCellRectLocation = gridProgram->attributeLocation("cellRect");
+            gridAtlasRectLocation = gridProgram->attributeLocation("atlasRect");
+            gridAtlasIndexLocation = gridProgram->attributeLocation("atlasIndex");
+        }
+        gridBuffer.create();
+        gridBuffer.setUsagePattern(QOpenGLBuffer::StreamDraw);
+
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+
+        QOpenGLContext* ctx = context();
+        unpackRowLengthSupported = !ctx->isOpenGLES() || ctx->format().majorVersion() >= 3;
+        redTexturesSupported = ctx->format().majorVersion() >= 3 || ctx->hasExtension("GL_ARB_texture_rg");
+        bgraSupported = !ctx->isOpenGLES() || ctx->hasExtension("GL_EXT_texture_format_BGRA8888");
+        instancingSupported = ctx->format().version() >= (ctx->isOpenGLES() ? qMakePair(3, 0) : qMakePair(3, 3));
+        compressTextures = compressTextures && (ctx->hasExtension("GL_EXT_texture_compression_s3tc")
+            || (ctx->hasExtension("GL_EXT_texture_compression_dxt1") && ctx->hasExtension("GL_ANGLE_texture_compression_dxt5")));
+        if (ctx->isOpenGLES()) {
+            pixelBuffersSupported = ctx->format().majorVersion() >= 3;
+        } else {
+            pixelBuffersSupported = ctx->format().version() >= qMakePair(2, 1) || ctx->hasExtension("GL_ARB_pixel_buffer_object");
+        }
+        for (int i = 0; i < pixelBufferCount && pixelBuffersSupported; ++i) {
+            pixelBuffers[i] = QOpenGLBuffer(QOpenGLBuffer::PixelUnpackBuffer);
+            pixelBuffers[i].setUsagePattern(QOpenGLBuffer::StreamDraw);
+            pixelBuffersSupported = pixelBuffers[i].create();
+        }
+#ifndef QT_OPENGL_ES_2
+        for (int i = 0; i < timerQueryCount; ++i) {
+            QOpenGLTimerQuery* query = new QOpenGLTimerQuery();
+            if (!query->create()) {
+                delete query;
+                break;
+            }
+            timerQueries.append(query);
+        }
+#endif
+
+        initialized = true;
+        if (!imageFiles.isEmpty() && (!streaming || !image.isNull())) {
+            if (image.isNull()) {
+                loadImage(0);
+            } else {
+                updateTexture(!streaming);
+            }
+        }
+    }
+
+    void paintGL() override {
+        QElapsedTimer cpuTimer;
+        cpuTimer.start();
+        advanceAnimation();
+        beginGpuTimer();
+        if (pumpUploads()) {
+            update();
+        }
+        if (gridMode) {
+            drawGrid();
+        } else if (!comparedKeys.isEmpty()) {
+            drawCompare();
+        } else {
+            advanceFrames();
+            drawScene();
+        }
+        endGpuTimer();
+        stats.cpuFrameMs = elapsedMilliseconds(cpuTimer);
+        if (hudVisible) {
+            drawHud();
+        }
+    }
+
+    void drawScene() {
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        QOpenGLTexture* drawn = shownFrame ? shownFrame : texture;
+        bool tiled = !shownFrame && tiledTexture.isActive();
+        bool pyramidal = !pyramid.isNull();
+        if ((!tiled && !pyramidal && (!drawn || !drawn->isCreated())) || !shaderProgram || !shaderProgram->isLinked()) {
+            return;
+        }
+
+        shaderProgram->bind();
+        if (vertexArray.isCreated()) {
+            vertexArray.bind();
+        } else {
+            bindQuadAttributes();
+        }
+
+        QRectF bounds = imageBounds();
+        if (pyramidal) {
+            drawPyramid(bounds);
+        } else if (tiled) {
+            if (drawTiles(bounds)) {
+                update();
+            }
+        } else {
+            drawQuad(drawn, bounds);
+        }
+
+        if (vertexArray.isCreated()) {
+            vertexArray.release();
+        } else {
+            glDisableVertexAttribArray(positionLocation);
+            glDisableVertexAttribArray(texCoordLocation);
+        }
+        shaderProgram->release();
+    }
+
+    void resizeGL(int w, int h) override {
+        glViewport(0, 0, w, h);
+        if (gridMode) {
+            scrollGrid(0);
+        }
+        clampPan();
+        refineIfNeeded();
+        scheduleMipmaps();
+    }
+
+    // Wheel events only move the zoom target; the frame-paced animation in
+    // paintGL() consumes however many arrived since the previous frame.
+    void wheelEvent(QWheelEvent* event) override {
+        if (gridMode) {
+            scrollGrid(-event->angleDelta().y() * gridCellSize / 120);
+            return;
+        }
+        float factor = std::pow(1.1f, event->angleDelta().y() / 120.0f);
+        float zoomed = qMax(0.1f, qMin(targetZoom * factor, maxZoom()));
+        if (zoomed == targetZoom) {
+            return;
+        }
+        targetZoom = zoomed;
+        zoomAnchor = toDeviceCoordinates(event->position());
+        if (!animationClock.isValid()) {
+            animationClock.start();
+        }
+        update();
+    }
+
+    void mousePressEvent(QMouseEvent* event) override {
+        if (gridMode) {
+            int index = gridIndexAt(event->pos());
+            if (event->button() == Qt::LeftButton && index >= 0) {
+                gridSelection = index;
+                update();
+            }
+            QOpenGLWidget::mousePressEvent(event);
+            return;
+        }
+        if (event->button() == Qt::LeftButton) {
+            dragging = true;
+            dragPosition = event->pos();
+            setCursor(Qt::ClosedHandCursor);
+        }
+        QOpenGLWidget::mousePressEvent(event);
+    }
+
+    void mouseMoveEvent(QMouseEvent* event) override {
+        if (dragging) {
+            QPoint moved = event->pos() - dragPosition;
+            dragPosition = event->pos();
+            QSize view = viewSize();
+            panOffset += QPointF(2.0 * moved.x() / view.width(), -2.0 * moved.y() / view.height());
+            clampPan();
+            update();
+        }
+        QOpenGLWidget::mouseMoveEvent(event);
+    }
+
+    void mouseDoubleClickEvent(QMouseEvent* event) override {
+        if (gridMode && event->button() == Qt::LeftButton && gridIndexAt(event->pos()) >= 0) {
+            closeGrid(true);
+            return;
+        }
+        QOpenGLWidget::mouseDoubleClickEvent(event);
+    }
+
+    void mouseReleaseEvent(QMouseEvent* event) override {
+        if (event->button() == Qt::LeftButton && dragging) {
+            dragging = false;
+            unsetCursor();
+        }
+        QOpenGLWidget::mouseReleaseEvent(event);
+    }
+
+    void keyPressEvent(QKeyEvent* event) override {
+        if (event->key() == Qt::Key_Q) {
+            window()->close();
+        } else if (gridMode) {
+            gridKeyPressed(event);
+        } else if (!comparedKeys.isEmpty() && (event->key() == Qt::Key_Left || event->key() == Qt::Key_Right)) {
+            stepReference(event->key() == Qt::Key_Right ? 1 : -1);
+        } else if (!comparedKeys.isEmpty() && event->key() == Qt::Key_D) {
+            compareDifference = (compareDifference + 1) % 3;
+            updateCompareTitle();
+            update();
+        } else if (event->key() == Qt::Key_G) {
+            openGrid();
+        } else if (event->key() == Qt::Key_Left || event->key() == Qt::Key_Right) {
+            stepImage(event->key() == Qt::Key_Right ? 1 : -1, event->isAutoRepeat());
+        } else if (comparedKeys.isEmpty() && (event->key() == Qt::Key_PageUp || event->key() == Qt::Key_PageDown)) {
+            stepImage(event->key() == Qt::Key_PageDown ? pageImages : -pageImages, event->isAutoRepeat());
+        } else if (comparedKeys.isEmpty() && (event->key() == Qt::Key_Home || event->key() == Qt::Key_End)) {
+            stepImage(event->key() == Qt::Key_End ? imageFiles.size() : -imageFiles.size(), false);
+        } else if (event->key() == Qt::Key_I) {
+            hudVisible = !hudVisible;
+            update();
+        } else if (event->key() == Qt::Key_N && !openedPath.isEmpty() && session->openWindow) {
+            session->openWindow(openedPath, window());
+        }
+        QOpenGLWidget::keyPressEvent(event);
+    }
+
+    void keyReleaseEvent(QKeyEvent* event) override {
+        if (scrubbing && !event->isAutoRepeat()) {
+            scrubbing = false;
+            loadImage(currentImageIndex);
+        }
+        QOpenGLWidget::keyReleaseEvent(event);
+    }
+
+private:
+    // What every window starts from; the public constructors then give it
+    // a path, an image or stdin to show.
+    ImageGLWidget(const QSharedPointer<ViewerSession>& session, bool streaming, QWidget* parent)
+        : QOpenGLWidget(parent), imageBottomUp(false), imageMapped(false), shaderProgram(session->shaderProgram), texture(nullptr), uncachedTexture(nullptr), VBO(session->VBO), EBO(session->EBO),
+          positionLocation(-1), texCoordLocation(-1), mvpLocation(-1), grayscaleLocation(-1), downscaleLocation(-1), texelSizeLocation(-1), scaleLocation(-1),
+          quadUniforms(session->quadUniforms), gridProgram(session->gridProgram), gridBuffer(QOpenGLBuffer::VertexBuffer), gridCornerBuffer(session->gridCornerBuffer),
+          differenceProgram(session->differenceProgram), gridCornerLocation(-1), gridCellRectLocation(-1), gridAtlasRectLocation(-1), gridAtlasIndexLocation(-1),
+          gridMode(false), gridScroll(0), gridSelection(0),
+          zoomLevel(1.0f), targetZoom(1.0f), compareReference(0), compareDifference(0), dragging(false), animatedKeys(session->animatedKeys), shownFrame(nullptr), shownFrameDelay(0), scanning(false), initialized(false), currentImageIndex(0),
+          prefetchRadius(session->options.prefetchRadius), readaheadCount(session->options.readaheadCount), navigationStep(1), scrubbing(false), reducedDecode(session->options.reducedDecode), displayedPreview(false), currentHasImage(false),
+          sourceSizes(session->sourceSizes), imageCache(session->imageCache), textureCache(session->textureCache),
+          pyramidTiles(session->vramBudgetBytes(), [this](QOpenGLTexture* evicted) { recycleTexture(evicted); }),
+          tileLoader(this, [this](const DecodeRequest& request, const DecodedImage& decoded) { pyramidTileDecoded(request, decoded); }),
+          maxTextureSize(0),
+          pixelBufferIndex(0), timerQueryIndex(0), hudVisible(false), pixelBuffersSupported(false), unpackRowLengthSupported(false), redTexturesSupported(false), bgraSupported(true), instancingSupported(false), compressTextures(session->options.compressTextures),
+          loader(session->loader), scanner(this, [this](const QVector<ImageEntry>& batch, bool finished) { entriesFound(batch, finished); }),
+          thumbnails(session->thumbnails),
+          stream(this, [this](const QImage& frame, bool finished) { streamFrameArrived(frame, finished); }),
+          streaming(streaming), streamFrames(0), session(session), sharesGL(false), opened(true) {
+        QSurfaceFormat format;
+        format.setVersion(2, 1);
+        format.setProfile(QSurfaceFormat::CompatibilityProfile);
+        setFormat(format);
+        setFocusPolicy(Qt::StrongFocus);
+        connect(this, &QOpenGLWidget::frameSwapped, this, &ImageGLWidget::continueAnimation);
+        joinSession();
+    }
+
+    void joinSession() {
+        session->addView(this, [this](const DecodeRequest& request, const DecodedImage& decoded) { imageDecoded(request, decoded); },
+                         [this](QOpenGLTexture* replaced, QOpenGLTexture* replacement) { textureReplaced(replaced, replacement); },
+                         [this]() { return keyDistances(); }, [this]() { trimTextures(); }, [this]() { return ownTextureBytes(); });
+    }
+
+    // How far each image this window may show soon is from the current one;
+    // the session evicts the farthest first.
+    QHash<QString, int> keyDistances() const {
+        QHash<QString, int> distances;
+        if (!displayedKey.isEmpty()) {
+            distances.insert(displayedKey, 0);
+        }
+        for (const QString& key : comparedKeys) {
+            distances.insert(key, 0);
+        }
+        if (currentImageIndex < 0) {
+            return distances;
+        }
+        int reach = prefetchRadius + readaheadCount;
+        for (int distance = 0; distance <= reach; ++distance) {
+            for (int index : {currentImageIndex + distance, currentImageIndex - distance}) {
+                if (index >= 0 && index < imageFiles.size()) {
+                    QString key = imageKey(index);
+                    if (!distances.contains(key)) {
+                        distances.insert(key, distance);
+                    }
+                }
+            }
+        }
+        return distances;
+    }
+
+    void trimTextures() {
+        if (!initialized) {
+            return;
+        }
+        makeCurrent();
+        session->trimTextures();
+        fitOwnTextures();
+        doneCurrent();
+        update();
+    }
+
+    // Gives up tiles not drawn this frame, then the least recently drawn
+    // pyramid tiles, while the session is over budget after evicting what
+    // it could. A context must be current.
+    void fitOwnTextures() {
+        qint64 room = session->reserveVram(0);
+        if (room < 0) {
+            tiledTexture.evict(tiledTexture.bytes() + room);
+            room = session->reserveVram(0);
+        }
+        if (room < 0) {
+            pyramidTiles.setMaxBytes(qMax<qint64>(0, pyramidTiles.bytes() + room));
+        }
+    }
+
+    void createSharedGL() {
+        ShareContextScope scope(&session->shareSurface);
+        QOpenGLFunctions* gl = QOpenGLContext::currentContext()->functions();
+        shaderProgram = new QOpenGLShaderProgram();
+        if (!shaderProgram->addShaderFromSourceCode(QOpenGLShader::Vertex, vertexShaderSource)
+            || !shaderProgram->addShaderFromSourceCode(QOpenGLShader::Fragment, fragmentShaderSource)
+            || !shaderProgram->link()) {
+            return;
+        }
+
+        gl->glGenBuffers(1, &VBO);
+        gl->glGenBuffers(1, &EBO);
+        if (VBO == 0 || EBO == 0) {
+            return;
+        }
+        gl->glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        gl->glBufferData(GL_ARRAY_BUFFER, sizeof(quadVertices), quadVertices, GL_STATIC_DRAW);
+        gl->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        gl->glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(quadIndices), quadIndices, GL_STATIC_DRAW);
+        gl->glBindBuffer(GL_ARRAY_BUFFER, 0);
+        gl->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+        gridProgram = new QOpenGLShaderProgram();
+        if (gridProgram->addShaderFromSourceCode(QOpenGLShader::Vertex, gridVertexShaderSource)
+            && gridProgram->addShaderFromSourceCode(QOpenGLShader::Fragment, gridFragmentShaderSource)
+            && gridProgram->link()) {
+            gridProgram->bind();
+            for (int i = 0; i < ThumbnailAtlas::atlasCount; ++i) {
+                gridProgram->setUniformValue(QString("atlas%1").arg(i).toLatin1().constData(), i);
+            }
+            gridProgram->release();
+        }
+        gridCornerBuffer.create();
+        gridCornerBuffer.bind();
+        gridCornerBuffer.allocate(gridCorners, sizeof(gridCorners));
+        gridCornerBuffer.release();
+
+        // Same attribute locations as the quad program, so the quad vertex
+        // arrays draw with either.
+        differenceProgram = new QOpenGLShaderProgram();
+        differenceProgram->bindAttributeLocation("position", shaderProgram->attributeLocation("position"));
+        differenceProgram->bindAttributeLocation("texCoord", shaderProgram->attributeLocation("texCoord"));
+        if (differenceProgram->addShaderFromSourceCode(QOpenGLShader::Vertex, vertexShaderSource)
+            && differenceProgram->addShaderFromSourceCode(QOpenGLShader::Fragment, differenceFragmentShaderSource)
+            && differenceProgram->link()) {
+            differenceProgram->bind();
+            differenceProgram->setUniformValue("image", 0);
+            differenceProgram->setUniformValue("reference", 1);
+            differenceProgram->release();
+        }
+    }
+
+    // Runs in the last window with its context current; the textures and
+    // programs are deleted in the share context that created them.
+    void destroySharedGL() {
+        ShareContextScope scope(&session->shareSurface);
+        QOpenGLFunctions* gl = QOpenGLContext::currentContext()->functions();
+        textureCache.clear();
+        qDeleteAll(session->recycledTextures);
+        session->recycledTextures.clear();
+        gridCornerBuffer.destroy();
+        delete differenceProgram;
+        differenceProgram = nullptr;
+        delete gridProgram;
+        gridProgram = nullptr;
+        delete shaderProgram;
+        shaderProgram = nullptr;
+        gl->glDeleteBuffers(1, &VBO);
+        gl->glDeleteBuffers(1, &EBO);
+        VBO = 0;
+        EBO = 0;
+        quadUniforms = QuadUniforms();
+    }
+
+    // Keeps the cached texture of the shown image from being evicted by
+    // another window.
+    void pinDisplayed(const QString& key) {
+        if (key == pinnedKey) {
+            return;
+        }
+        if (!pinnedKey.isEmpty()) {
+            textureCache.unpin(pinnedKey);
+        }
+        pinnedKey = key;
+        if (!pinnedKey.isEmpty()) {
+            textureCache.pin(pinnedKey);
+        }
+    }
+
+    // A replacement that did not fit the cache belongs to the window that
+    // made it, so the others upload their own copy from the image cache.
+    void textureReplaced(QOpenGLTexture* replaced, QOpenGLTexture* replacement) {
+        if (texture != replaced) {
+            return;
+        }
+        texture = replacement;
+        if (!replacement) {
+            displayedKey.clear();
+            pinDisplayed(QString());
+            QMetaObject::invokeMethod(this, [this]() {
+                DecodedImage* cached = imageCache.object(currentKey);
+                if (cached && displayedKey != currentKey) {
+                    showImage(DecodedImage(*cached));
+                }
+            }, Qt::QueuedConnection);
+        }
+        update();
+    }
+
+    // GPU time is read back from the query issued timerQueryCount frames ago,
+    // so the HUD never stalls the pipeline waiting for the current frame.
+    void beginGpuTimer() {
+#ifndef QT_OPENGL_ES_2
+        if (timerQueries.isEmpty()) {
+            return;
+        }
+        QOpenGLTimerQuery* query = timerQueries[timerQueryIndex];
+        if (pendingTimerQueries.contains(timerQueryIndex)) {
+            stats.gpuFrameMs = query->waitForResult() / 1000000.0;
+            pendingTimerQueries.remove(timerQueryIndex);
+        }
+        query->begin();
+#endif
+    }
+
+    void endGpuTimer() {
+#ifndef QT_OPENGL_ES_2
+        if (timerQueries.isEmpty()) {
+            return;
+        }
+        timerQueries[timerQueryIndex]->end();
+        pendingTimerQueries.insert(timerQueryIndex);
+        timerQueryIndex = (timerQueryIndex + 1) % timerQueries.size();
+#endif
+    }
+
+    // What this window holds outside the shared cache.
+    qint64 ownTextureBytes() const {
+        qint64 bytes = tiledTexture.bytes() + pyramidTiles.bytes();
+        if (uncachedTexture) {
+            bytes += textureBytes(uncachedTexture);
+        }
+        if (shownFrame) {
+            bytes += textureBytes(shownFrame);
+        }
+        for (const UploadedFrame& frame : uploadedFrames) {
+            bytes += textureBytes(frame.texture);
+        }
+        for (const QOpenGLTexture* spare : spareFrameTextures) {
+            bytes += textureBytes(spare);
+        }
+        for (const PendingUpload& upload : uploads) {
+            bytes += textureBytes(upload.texture);
+        }
+        for (const QOpenGLTexture* owned : comparedOwned) {
+            bytes += textureBytes(owned);
+        }
+        return bytes;
+    }
+
+    void drawHud() {
+        int lookups = stats.textureHits + stats.imageHits + stats.misses;
+        double hitRate = lookups > 0 ? 100.0 * (stats.textureHits + stats.imageHits) / lookups : 0.0;
+        QStringList lines;
+        lines << QString("frame   cpu %1 ms  gpu %2").arg(stats.cpuFrameMs, 0, 'f', 2)
+            .arg(stats.gpuFrameMs >= 0.0 ? QString::number(stats.gpuFrameMs, 'f', 2) + " ms" : QString("n/a"));
+        lines << QString("decode  %1 ms").arg(stats.decodeMs, 0, 'f', 1);
+        lines << QString("upload  %1 ms").arg(stats.uploadMs, 0, 'f', 1);
+        lines << QString("cache   %1% hit  (vram %2, ram %3, miss %4)").arg(hitRate, 0, 'f', 0)
+            .arg(stats.textureHits).arg(stats.imageHits).arg(stats.misses);
+        lines << QString("vram    %1 MB  (budget %2 MB)").arg(session->vramBytes() / 1048576.0, 0, 'f', 1).arg(session->vramBudgetBytes() / 1048576.0, 0, 'f', 0);
+        lines << QString("ram     %1 MB  (budget %2 MB)").arg(session->ramBytes() / 1048576.0, 0, 'f', 1).arg(session->ramBudgetBytes() / 1048576.0, 0, 'f', 0);
+
+        QPainter painter(this);
+        painter.setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
+        QFontMetrics metrics = painter.fontMetrics();
+        int textWidth = 0;
+        for (const QString& line : lines) {
+            textWidth = qMax(textWidth, metrics.horizontalAdvance(line));
+        }
+        QRect box(8, 8, textWidth + 16, metrics.height() * lines.size() + 12);
+        painter.fillRect(box, QColor(0, 0, 0, 160));
+        painter.setPen(Qt::white);
+        for (int i = 0; i < lines.size(); ++i) {
+            painter.drawText(box.left() + 8, box.top() + 6 + metrics.ascent() + i * metrics.height(), lines[i]);
+        }
+    }
+
+    int gridColumns() const {
+        return qMax(1, width() / gridCellSize);
+    }
+
+    int gridRows() const {
+        return (imageFiles.size() + gridColumns() - 1) / gridColumns();
+    }
+
+    // Cell of index in widget coordinates, rows laid out top to bottom.
+    QRect gridCellRect(int index) const {
+        int columns = gridColumns();
+        int left = (width() - columns * gridCellSize) / 2;
+        return QRect(left + index % columns * gridCellSize, index / columns * gridCellSize - gridScroll, gridCellSize, gridCellSize);
+    }
+
+    int gridIndexAt(const QPoint& position) const {
+        int columns = gridColumns();
+        int column = (position.x() - (width() - columns * gridCellSize) / 2) / gridCellSize;
+        int index = (position.y() + gridScroll) / gridCellSize * columns + column;
+        if (column < 0 || column >= columns || index < 0 || index >= imageFiles.size()) {
+            return -1;
+        }
+        return index;
+    }
+
+    void openGrid() {
+        if (imageFiles.isEmpty()) {
+            return;
+        }
+        gridMode = true;
+        gridSelection = qMax(0, currentImageIndex);
+        revealGridSelection();
+        update();
+    }
+
+    void closeGrid(bool openSelection) {
+        gridMode = false;
+        if (openSelection && gridSelection != currentImageIndex) {
+            loadImage(gridSelection);
+        } else {
+            prefetch(currentImageIndex);
+        }
+        update();
+    }
+
+    void gridKeyPressed(QKeyEvent* event) {
+        int step = 0;
+        switch (event->key()) {
+        case Qt::Key_G:
+        case Qt::Key_Escape:
+            closeGrid(false);
+            return;
+        case Qt::Key_Return:
+        case Qt::Key_Enter:
+            closeGrid(true);
+            return;
+        case Qt::Key_Left:
+            step = -1;
+            break;
+        case Qt::Key_Right:
+            step = 1;
+            break;
+        case Qt::Key_Up:
+            step = -gridColumns();
+            break;
+        case Qt::Key_Down:
+            step = gridColumns();
+            break;
+        case Qt::Key_PageUp:
+            step = -gridColumns() * qMax(1, height() / gridCellSize);
+            break;
+        case Qt::Key_PageDown:
+            step = gridColumns() * qMax(1, height() / gridCellSize);
+            break;
+        case Qt::Key_Home:
+            step = -imageFiles.size();
+            break;
+        case Qt::Key_End:
+            step = imageFiles.size();
+            break;
+        default:
+            return;
+        }
+        gridSelection = qBound(0, gridSelection + step, imageFiles.size() - 1);
+        revealGridSelection();
+        update();
+    }
+
+    void revealGridSelection() {
+        QRect cell = gridCellRect(gridSelection);
+        if (cell.top() < 0) {
+            scrollGrid(cell.top());
+        } else if (cell.bottom() >= height()) {
+            scrollGrid(cell.bottom() + 1 - height());
+        } else {
+            scrollGrid(0);
+        }
+    }
+
+    void scrollGrid(int delta) {
+        int maxScroll = qMax(0, gridRows() * gridCellSize - height());
+        gridScroll = qBound(0, gridScroll + delta, maxScroll);
+        requestGridCells();
+        update();
+    }
+
+    // Only rows within gridPrefetchRows of the viewport are decoded; jobs for
+    // rows that scrolled further away are cancelled.
+    void requestGridCells() {
+        int columns = gridColumns();
+        int firstVisible = gridScroll / gridCellSize * columns;
+        int lastVisible = qMin(imageFiles.size(), ((gridScroll + height()) / gridCellSize + 1) * columns);
+        int first = qMax(0, firstVisible - gridPrefetchRows * columns);
+        int last = qMin(imageFiles.size(), lastVisible + gridPrefetchRows * columns);
+        QSet<QString> wanted;
+        for (int i = first; i < last; ++i) {
+            wanted.insert(imageKey(i));
+        }
+        session->retain(this, wanted);
+        for (int i = first; i < last; ++i) {
+            QString key = imageKey(i);
+            if (thumbnailAtlas.contains(key) || failedCells.contains(key)) {
+                continue;
+            }
+            QString storeKey = thumbnailKey(i);
+            DecodeRequest request;
+            request.key = key;
+            request.path = imagePath(i);
+            request.cell = true;
+            request.targetSize = QSize(thumbnailSize, thumbnailSize);
+            request.priority = i >= firstVisible && i < lastVisible ? 1 : 0;
+            request.thumbnail = thumbnails.find(storeKey);
+            if (request.thumbnail.isEmpty() && thumbnails.isEnabled()) {
+                request.thumbnailKey = storeKey;
+            }
+            loader.request(request);
+        }
+    }
+
+    void cellDecoded(const DecodeRequest& request, const DecodedImage& decoded) {
+        if (decoded.image.isNull()) {
+            failedCells.insert(request.key);
+            return;
+        }
+        if (!gridMode || thumbnailAtlas.contains(request.key)) {
+            return;
+        }
+        makeCurrent();
+        if (thumbnailAtlas.isCreated() || thumbnailAtlas.create()) {
+            ThumbnailAtlas::Slot* slot = thumbnailAtlas.allocate(request.key, decoded.image.size());
+            if (slot) {
+                uploadRegion(thumbnailAtlas.texture(slot->atlas), decoded.image, false, decoded.image.rect(), slot->origin);
+            }
+        }
+        doneCurrent();
+        update();
+    }
+
+    // Draws every visible thumbnail with one instanced draw call, or with one
+    // non-indexed draw of expanded vertices where instancing is unavailable.
+    void drawGrid() {
+        glClearColor(0.12f, 0.12f, 0.12f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+        if (!thumbnailAtlas.isCreated() || !gridProgram || !gridProgram->isLinked()) {
+            return;
+        }
+        thumbnailAtlas.beginFrame();
+        qreal ratio = devicePixelRatioF();
+        QRect selected = gridCellRect(gridSelection).adjusted(gridPadding / 2, gridPadding / 2, -gridPadding / 2, -gridPadding / 2);
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(qRound(selected.left() * ratio), qRound((height() - selected.bottom() - 1) * ratio),
+            qRound(selected.width() * ratio), qRound(selected.height() * ratio));
+        glClearColor(0.25f, 0.45f, 0.85f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+        glDisable(GL_SCISSOR_TEST);
+
+        int columns = gridColumns();
+        int first = gridScroll / gridCellSize * columns;
+        int last = qMin(imageFiles.size(), ((gridScroll + height()) / gridCellSize + 1) * columns);
+        QVector<GridInstance> instances;
+        instances.reserve(last - first);
+        for (int i = first; i < last; ++i) {
+            const ThumbnailAtlas::Slot* slot = thumbnailAtlas.find(imageKey(i));
+            if (!slot) {
+                continue;
+            }
+            QRect cell = gridCellRect(i).adjusted(gridPadding, gridPadding, -gridPadding, -gridPadding);
+            QSize fitted = slot->size.scaled(cell.size(), Qt::KeepAspectRatio);
+            QRectF box(cell.left() + (cell.width() - fitted.width()) / 2.0, cell.top() + (cell.height() - fitted.height()) / 2.0,
+                fitted.width(), fitted.height());
+            GridInstance instance;
+            instance.cellRect[0] = 2.0 * box.left() / width() - 1.0;
+            instance.cellRect[1] = 1.0 - 2.0 * box.bottom() / height();
+            instance.cellRect[2] = 2.0 * box.right() / width() - 1.0;
+            instance.cellRect[3] = 1.0 - 2.0 * box.top() / height();
+            qreal scale = 1.0 / ThumbnailAtlas::atlasSize;
+            instance.atlasRect[0] = slot->origin.x() * scale;
+            instance.atlasRect[1] = (slot->origin.y() + slot->size.height()) * scale;
+            instance.atlasRect[2] = (slot->origin.x() + slot->size.width()) * scale;
+            instance.atlasRect[3] = slot->origin.y() * scale;
+            instance.atlasIndex = slot->atlas;
+            instances.append(instance);
+        }
+        if (instances.isEmpty()) {
+            return;
+        }
+
+        gridProgram->bind();
+        for (int i = 0; i < ThumbnailAtlas::atlasCount; ++i) {
+            thumbnailAtlas.texture(i)->bind(i);
+        }
+        GLint instanceLocations[] = { gridCellRectLocation, gridAtlasRectLocation, gridAtlasIndexLocation };
+        int instanceSizes[] = { 4, 4, 1 };
+        size_t instanceOffsets[] = { offsetof(GridInstance, cellRect), offsetof(GridInstance, atlasRect), offsetof(GridInstance, atlasIndex) };
+        if (instancingSupported) {
+            QOpenGLExtraFunctions* extra = context()->extraFunctions();
+            gridCornerBuffer.bind();
+            glVertexAttribPointer(gridCornerLocation, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+            glEnableVertexAttribArray(gridCornerLocation);
+            gridBuffer.bind();
+            gridBuffer.allocate(instances.constData(), instances.size() * sizeof(GridInstance));
+            for (int k = 0; k < 3; ++k) {
+                glVertexAttribPointer(instanceLocations[k], instanceSizes[k], GL_FLOAT, GL_FALSE, sizeof(GridInstance), (void*)instanceOffsets[k]);
+                glEnableVertexAttribArray(instanceLocations[k]);
+                extra->glVertexAttribDivisor(instanceLocations[k], 1);
+            }
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+            extra->glDrawElementsInstanced(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0, instances.size());
+            for (int k = 0; k < 3; ++k) {
+                extra->glVertexAttribDivisor(instanceLocations[k], 0);
+            }
+        } else {
+            QVector<GridVertex> vertices;
+            vertices.reserve(instances.size() * 6);
+            for (const GridInstance& instance : instances) {
+                for (int k = 0; k < 6; ++k) {
+                    GridVertex vertex;
+                    vertex.corner[0] = gridCorners[quadIndices[k] * 2];
+                    vertex.corner[1] = gridCorners[quadIndices[k] * 2 + 1];
+                    vertex.instance = instance;
+                    vertices.append(vertex);
+                }
+            }
+            gridBuffer.bind();
+            gridBuffer.allocate(vertices.constData(), vertices.size() * sizeof(GridVertex));
+            glVertexAttribPointer(gridCornerLocation, 2, GL_FLOAT, GL_FALSE, sizeof(GridVertex), (void*)offsetof(GridVertex, corner));
+            glEnableVertexAttribArray(gridCornerLocation);
+            for (int k = 0; k < 3; ++k) {
+                glVertexAttribPointer(instanceLocations[k], instanceSizes[k], GL_FLOAT, GL_FALSE, sizeof(GridVertex),
+                    (void*)(offsetof(GridVertex, instance) + instanceOffsets[k]));
+                glEnableVertexAttribArray(instanceLocations[k]);
+            }
+            glDrawArrays(GL_TRIANGLES, 0, vertices.size());
+        }
+        glDisableVertexAttribArray(gridCornerLocation);
+        for (int k = 0; k < 3; ++k) {
+            glDisableVertexAttribArray(instanceLocations[k]);
+        }
+        gridBuffer.release();
+        glActiveTexture(GL_TEXTURE0);
+        gridProgram->release();
+    }
+
+    QRectF imageBounds() const {
+        return imageBounds(imageSize);
+    }
+
+    // Where an image of the given size is drawn in device coordinates of
+    // the view, fitted to it and then zoomed and panned.
+    QRectF imageBounds(const QSize& fitted) const {
+        QSize view = viewSize();
+        float imageAspect = static_cast<float>(fitted.width()) / fitted.height();
+        float windowAspect = static_cast<float>(view.width()) / view.height();
+        float scaleX = 1.0f;
+        float scaleY = 1.0f;
+
+        if (imageAspect > windowAspect) {
+            scaleY = windowAspect / imageAspect;
+        } else {
+            scaleX = imageAspect / windowAspect;
+        }
+
+        scaleX *= zoomLevel;
+        scaleY *= zoomLevel;
+        return QRectF(panOffset.x() - scaleX, panOffset.y() - scaleY, 2.0f * scaleX, 2.0f * scaleY);
+    }
+
+    // Relative to the compare cell under position when comparing.
+    QPointF toDeviceCoordinates(const QPointF& position) const {
+        QSize view = viewSize();
+        qreal x = std::fmod(position.x(), static_cast<qreal>(view.width()));
+        qreal y = std::fmod(position.y(), static_cast<qreal>(view.height()));
+        return QPointF(2.0 * x / view.width() - 1.0, 1.0 - 2.0 * y / view.height());
+    }
+
+    // Logical size of the area an image is fitted into: the widget, or one
+    // cell of the compare layout.
+    QSize viewSize() const {
+        if (comparedKeys.isEmpty()) {
+            return size();
+        }
+        return QSize(qMax(1, width() / compareColumns()), qMax(1, height() / compareRows()));
+    }
+
+    int compareColumns() const {
+        return qMax(1, static_cast<int>(std::ceil(std::sqrt(static_cast<double>(comparedKeys.size())))));
+    }
+
+    int compareRows() const {
+        int columns = compareColumns();
+        return qMax(1, (comparedKeys.size() + columns - 1) / columns);
+    }
+
+    // Keeps the image covering the window along each axis where it is larger
+    // than the window, and centred where it is smaller.
+    void clampPan() {
+        QRectF bounds = imageBounds();
+        qreal slackX = qMax<qreal>(0.0, bounds.width() / 2.0 - 1.0);
+        qreal slackY = qMax<qreal>(0.0, bounds.height() / 2.0 - 1.0);
+        panOffset.setX(qBound(-slackX, panOffset.x(), slackX));
+        panOffset.setY(qBound(-slackY, panOffset.y(), slackY));
+    }
+
+    // Eases zoomLevel towards targetZoom with a time constant independent of
+    // the refresh rate, keeping the image point under zoomAnchor fixed.
+    void advanceAnimation() {
+        if (!animationClock.isValid()) {
+            return;
+        }
+        qreal elapsed = animationClock.restart() / 1000.0;
+        float previous = zoomLevel;
+        float step = static_cast<float>(1.0 - std::exp(-elapsed / zoomTimeConstant));
+        zoomLevel += (targetZoom - zoomLevel) * step;
+        if (std::fabs(targetZoom / zoomLevel - 1.0f) < 0.002f) {
+            zoomLevel = targetZoom;
+        }
+        panOffset = zoomAnchor - (zoomAnchor - panOffset) * (zoomLevel / previous);
+        clampPan();
+        if (zoomLevel == targetZoom) {
+            animationClock.invalidate();
+            refineIfNeeded();
+            scheduleMipmaps();
+        }
+    }
+
+    void continueAnimation() {
+        if (animationClock.isValid() || animation.isActive()) {
+            update();
+        }
+    }
+
+    void startAnimation() {
+        if (animationKey == currentKey || currentImageIndex < 0 || currentImageIndex >= imageFiles.size()) {
+            return;
+        }
+        stopAnimation();
+        animationKey = currentKey;
+        animation.start(imagePath(currentImageIndex));
+        update();
+    }
+
+    void stopAnimation() {
+        animation.stop();
+        animationKey.clear();
+        makeCurrent();
+        for (int i = 0; i < uploadedFrames.size(); ++i) {
+            spareFrameTextures.append(uploadedFrames[i].texture);
+        }
+        uploadedFrames.clear();
+        if (shownFrame) {
+            spareFrameTextures.append(shownFrame);
+            shownFrame = nullptr;
+        }
+        qDeleteAll(spareFrameTextures);
+        spareFrameTextures.clear();
+        doneCurrent();
+    }
+
+    // Keeps a few frames uploaded ahead into reused textures and flips to the
+    // next one once the shown frame's delay has passed. Called once per
+    // frame from paintGL(), so playback is paced by buffer swaps.
+    void advanceFrames() {
+        if (!animation.isActive()) {
+            return;
+        }
+        AnimationFrame frame;
+        if (uploadedFrames.size() < frameTextureCount - 1 && animation.nextFrame(&frame)) {
+            QImage pixels = bgraSupported ? frame.image : rgbOrderedImage(frame.image);
+            PixelTransfer transfer;
+            if (pixelTransfer(pixels.format(), redTexturesSupported, &transfer)
+                && pixels.width() <= maxTextureSize && pixels.height() <= maxTextureSize) {
+                QOpenGLTexture* target = nullptr;
+                while (!spareFrameTextures.isEmpty() && !target) {
+                    target = spareFrameTextures.takeFirst();
+                    if (target->width() != pixels.width() || target->height() != pixels.height() || target->format() != transfer.textureFormat) {
+                        delete target;
+                        target = nullptr;
+                    }
+                }
+                if (!target) {
+                    target = acquireTexture(pixels.size(), transfer.textureFormat, false);
+                }
+                if (target) {
+                    uploadRegion(target, pixels, false, pixels.rect(), QPoint(0, 0));
+                    UploadedFrame uploaded;
+                    uploaded.texture = target;
+                    uploaded.delayMs = frame.delayMs;
+                    uploadedFrames.append(uploaded);
+                }
+            }
+        }
+        if (shownFrame && frameClock.elapsed() < shownFrameDelay) {
+            return;
+        }
+        if (uploadedFrames.isEmpty()) {
+            if (animation.isFinished()) {
+                animation.stop();
+            }
+            return;
+        }
+        UploadedFrame next = uploadedFrames.takeFirst();
+        if (shownFrame) {
+            spareFrameTextures.append(shownFrame);
+        }
+        // Late frames shorten the next delay instead of drifting, unless
+        // playback fell more than a whole frame behind.
+        qint64 late = shownFrame ? frameClock.elapsed() - shownFrameDelay : 0;
+        shownFrame = next.texture;
+        shownFrameDelay = static_cast<int>(qMax<qint64>(0, next.delayMs - (late < next.delayMs ? late : 0)));
+        frameClock.start();
+    }
+
+    void bindQuadAttributes() {
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        glVertexAttribPointer(positionLocation, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
+        glVertexAttribPointer(texCoordLocation, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)(2 * sizeof(float)));
+        glEnableVertexAttribArray(positionLocation);
+        glEnableVertexAttribArray(texCoordLocation);
+    }
+
+    // Uniforms persist in the program, so they are only rewritten when the
+    // quad, its texture or the window scale differ from the previous draw.
+    void drawQuad(QOpenGLTexture* quadTexture, const QRectF& rect) {
+        QuadUniforms uniforms;
+        uniforms.rect = rect;
+        uniforms.textureSize = QSize(quadTexture->width(), quadTexture->height());
+        uniforms.minification = minification(quadTexture, rect);
+        uniforms.grayscale = quadTexture->format() == QOpenGLTexture::R8_UNorm;
+        uniforms.mipmapped = quadTexture->mipLevels() > 1;
+        if (uniforms.rect != quadUniforms.rect) {
+            QMatrix4x4 mvp;
+            mvp.translate(rect.center().x(), rect.center().y());
+            mvp.scale(rect.width() / 2.0f, rect.height() / 2.0f, 1.0f);
+            shaderProgram->setUniformValue(mvpLocation, mvp);
+        }
+        if (uniforms != quadUniforms) {
+            shaderProgram->setUniformValue(grayscaleLocation, static_cast<GLint>(uniforms.grayscale));
+            shaderProgram->setUniformValue(downscaleLocation, static_cast<GLint>(uniforms.minification > 1.0 && !uniforms.mipmapped));
+            shaderProgram->setUniformValue(texelSizeLocation, QVector2D(1.0f / uniforms.textureSize.width(), 1.0f / uniforms.textureSize.height()));
+            shaderProgram->setUniformValue(scaleLocation, static_cast<GLfloat>(qBound<qreal>(1.0, uniforms.minification, maxShaderDownscale)));
+            quadUniforms = uniforms;
+        }
+
+        quadTexture->bind();
+        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+    }
+
+    // Source texels per physical screen pixel when drawn into rect.
+    qreal minification(const QOpenGLTexture* drawn, const QRectF& rect) const {
+        qreal drawnWidth = rect.width() / 2.0 * viewSize().width() * devicePixelRatioF();
+        return drawnWidth > 0.0 ? drawn->width() / drawnWidth : 1.0;
+    }
+
+    // Textures start without a mip chain and are drawn through the Lanczos
+    // path of the fragment shader. Only once the view shrinks an image beyond
+    // what that filter covers is it uploaded again with mipmaps.
+    void scheduleMipmaps() {
+        QMetaObject::invokeMethod(this, [this]() { buildMipmapsIfMinified(); }, Qt::QueuedConnection);
+    }
+
+    void buildMipmapsIfMinified() {
+        if (!texture || displayedKey != currentKey || displayedPreview || texture->mipLevels() > 1
+            || minification(texture, imageBounds()) <= maxShaderDownscale) {
+            return;
+        }
+        DecodedImage* cached = imageCache.object(currentKey);
+        if (!cached || cached->image.size() != QSize(texture->width(), texture->height())) {
+            return;
+        }
+        image = cached->image;
+        imageBottomUp = cached->bottomUp;
+        imageMapped = false;
+        updateTexture(true, true);
+        update();
+    }
+
+    bool drawTiles(const QRectF& bounds) {
+        const QImage& source = tiledTexture.image();
+        qreal tileWidth = bounds.width() * TiledTexture::tileSize / source.width();
+        qreal tileHeight = bounds.height() * TiledTexture::tileSize / source.height();
+        int firstColumn = qMax(0, static_cast<int>(std::floor((-1.0 - bounds.left()) / tileWidth)));
+        int lastColumn = qMin(tiledTexture.columns() - 1, static_cast<int>(std::floor((1.0 - bounds.left()) / tileWidth)));
+        int firstRow = qMax(0, static_cast<int>(std::floor((bounds.bottom() - 1.0) / tileHeight)));
+        int lastRow = qMin(tiledTexture.rows() - 1, static_cast<int>(std::floor((bounds.bottom() + 1.0) / tileHeight)));
+
+        tiledTexture.beginFrame();
+        qint64 budget = uploadBytesPerFrame;
+        bool missing = false;
+        for (int row = firstRow; row <= lastRow; ++row) {
+            for (int column = firstColumn; column <= lastColumn; ++column) {
+                QOpenGLTexture* tile = tiledTexture.tile(column, row);
+                QRect region = tiledTexture.tileRect(column, row);
+                if (!tile) {
+                    if (budget <= 0) {
+                        missing = true;
+                        continue;
+                    }
+                    tile = createTile(region);
+                    if (!tile) {
+                        continue;
+                    }
+                    tiledTexture.insert(column, row, tile);
+                    budget -= static_cast<qint64>(region.width()) * region.height() * 4;
+                }
+                qreal left = bounds.left() + bounds.width() * region.left() / source.width();
+                qreal top = bounds.bottom() - bounds.height() * region.top() / source.height();
+                qreal width = bounds.width() * region.width() / source.width();
+                qreal height = bounds.height() * region.height() / source.height();
+                drawQuad(tile, QRectF(left, top - height, width, height));
+            }
+        }
+        fitOwnTextures();
+        return missing;
+    }
+
+    QOpenGLTexture* createTile(const QRect& region) {
+        PixelTransfer transfer;
+        pixelTransfer(tiledTexture.image().format(), redTexturesSupported, &transfer);
+        QOpenGLTexture* tile = acquireTexture(region.size(), transfer.textureFormat, true);
+        if (!tile) {
+            return nullptr;
+        }
+        tile->setWrapMode(QOpenGLTexture::ClampToEdge);
+        uploadRegion(tile, tiledTexture.image(), tiledTexture.isBottomUp(), region, QPoint(0, 0));
+        tile->generateMipMaps();
+        return tile;
+    }
+
+    // Pyramids may be zoomed until a source pixel covers four on screen.
+    float maxZoom() const {
+        if (pyramid.isNull()) {
+            return 10.0f;
+        }
+        qreal fittedWidth = imageBounds().width() / zoomLevel / 2.0 * viewSize().width() * devicePixelRatioF();
+        return qMax(10.0f, static_cast<float>(4.0 * pyramid.size.width() / fittedWidth));
+    }
+
+    // Draws the backdrop level, then what is cached of the level below the
+    // wanted one, then the wanted level, the coarsest whose pixels are no
+    // larger than the screen's: so the view sharpens as tiles arrive and
+    // the shader never minifies by more than two.
+    void drawPyramid(const QRectF& bounds) {
+        qreal shownWidth = bounds.width() / 2.0 * viewSize().width() * devicePixelRatioF();
+        int base = pyramid.baseLevel();
+        int level = pyramid.maxLevel();
+        while (level > base && pyramid.levelSize(level - 1).width() >= shownWidth) {
+            --level;
+        }
+        QSet<QString> wanted;
+        drawPyramidLevel(base, bounds, &wanted);
+        if (level - 1 > base) {
+            drawPyramidLevel(level - 1, bounds, nullptr);
+        }
+        if (level > base) {
+            drawPyramidLevel(level, bounds, &wanted);
+        }
+        tileLoader.cancelExcept(wanted);
+    }
+
+    // Tiles missing from the cache are requested when wanted is given.
+    void drawPyramidLevel(int level, const QRectF& bounds, QSet<QString>* wanted) {
+        QSize levelSize = pyramid.levelSize(level);
+        qreal tileWidth = bounds.width() * pyramid.tileSize / levelSize.width();
+        qreal tileHeight = bounds.height() * pyramid.tileSize / levelSize.height();
+        int firstColumn = qMax(0, static_cast<int>(std::floor((-1.0 - bounds.left()) / tileWidth)));
+        int lastColumn = qMin(pyramid.columns(level) - 1, static_cast<int>(std::floor((1.0 - bounds.left()) / tileWidth)));
+        int firstRow = qMax(0, static_cast<int>(std::floor((bounds.bottom() - 1.0) / tileHeight)));
+        int lastRow = qMin(pyramid.rows(level) - 1, static_cast<int>(std::floor((bounds.bottom() + 1.0) / tileHeight)));
+        for (int row = firstRow; row <= lastRow; ++row) {
+            for (int column = firstColumn; column <= lastColumn; ++column) {
+                QString key = pyramidTileKey(level, column, row);
+                QOpenGLTexture* tile = pyramidTiles.object(key);
+                if (!tile) {
+                    if (wanted && !failedPyramidTiles.contains(key)) {
+                        wanted->insert(key);
+                        DecodeRequest request;
+                        request.key = key;
+                        request.path = pyramid.tilePath(level, column, row);
+                        request.priority = level == pyramid.baseLevel() ? 1 : 0;
+                        tileLoader.request(request);
+                    }
+                    continue;
+                }
+                QRect region = pyramid.tileRect(level, column, row);
+                qreal left = bounds.left() + bounds.width() * region.left() / levelSize.width();
+                qreal top = bounds.bottom() - bounds.height() * region.top() / levelSize.height();
+                qreal width = bounds.width() * region.width() / levelSize.width();
+                qreal height = bounds.height() * region.height() / levelSize.height();
+                drawQuad(tile, QRectF(left, top - height, width, height));
+            }
+        }
+    }
+
+    QString pyramidTileKey(int level, int column, int row) const {
+        return currentKey + QString("#%1/%2_%3").arg(level).arg(column).arg(row);
+    }
+
+    void pyramidTileDecoded(const DecodeRequest& request, const DecodedImage& decoded) {
+        if (pyramid.isNull() || !request.key.startsWith(currentKey + '#')) {
+            return;
+        }
+        if (decoded.image.isNull()) {
+            failedPyramidTiles.insert(request.key);
+            return;
+        }
+        QImage uploadable = bgraSupported ? decoded.image : rgbOrderedImage(decoded.image);
+        PixelTransfer transfer;
+        pixelTransfer(uploadable.format(), redTexturesSupported, &transfer);
+        makeCurrent();
+        QOpenGLTexture* tile = acquireTexture(uploadable.size(), transfer.textureFormat, false);
+        if (tile) {
+            tile->setWrapMode(QOpenGLTexture::ClampToEdge);
+            uploadRegion(tile, uploadable, decoded.bottomUp, uploadable.rect(), QPoint(0, 0));
+            qint64 bytes = textureBytes(tile);
+            pyramidTiles.setMaxBytes(qMax(bytes, pyramidTiles.bytes() + session->reserveVram(bytes)));
+            if (!pyramidTiles.insert(request.key, tile, bytes)) {
+                recycleTexture(tile);
+            }
+        }
+        doneCurrent();
+        update();
+    }
+
+    void showPyramid(const QString& path) {
+        DeepZoomPyramid opened = readDeepZoomPyramid(path);
+        if (opened.isNull()) {
+            window()->close();
+            return;
+        }
+        makeCurrent();
+        recycleTexture(uncachedTexture);
+        uncachedTexture = nullptr;
+        tiledTexture.clear();
+        texture = nullptr;
+        pyramid = opened;
+        imageSize = pyramid.size;
+        sourceSizes.insert(currentKey, pyramid.size);
+        displayedKey = currentKey;
+        pinDisplayed(displayedKey);
+        displayedPreview = false;
+        doneCurrent();
+        update();
+    }
+
+    void closePyramid() {
+        if (pyramid.isNull()) {
+            return;
+        }
+        tileLoader.cancelAll();
+        makeCurrent();
+        pyramidTiles.clear();
+        doneCurrent();
+        failedPyramidTiles.clear();
+        pyramid = DeepZoomPyramid();
+    }
+
+    void loadImage(int index) {
+        if (index < 0 || index >= imageFiles.size()) {
+            return;
+        }
+        if (index != currentImageIndex) {
+            navigationStep = index < currentImageIndex ? -1 : 1;
+        }
+        currentImageIndex = index;
+        updateTitle();
+        currentKey = imageKey(index);
+        currentHasImage = false;
+        zoomLevel = 1.0f;
+        targetZoom = 1.0f;
+        panOffset = QPointF();
+        animationClock.invalidate();
+        if (animationKey != currentKey) {
+            stopAnimation();
+        }
+        cancelUploads();
+        scrubPendingKey.clear();
+        prefetch(index);
+        closePyramid();
+        if (isDeepZoomPath(imageFiles[index].name)) {
+            currentHasImage = true;
+            showPyramid(imagePath(index));
+        } else if (textureCache.contains(currentKey)) {
+            ++stats.textureHits;
+            currentHasImage = true;
+            showCachedTexture();
+        } else if (DecodedImage* cached = imageCache.object(currentKey)) {
+            ++stats.imageHits;
+            currentHasImage = true;
+            showImage(*cached);
+        } else {
+            ++stats.misses;
+            DecodeRequest request;
+            request.key = currentKey;
+            request.path = imagePath(index);
+            request.preview = true;
+            request.thumbnail = thumbnails.find(thumbnailKey(index));
+            request.priority = prefetchRadius + 2;
+            loader.request(request);
+        }
+        if (animatedKeys.contains(currentKey)) {
+            startAnimation();
+        }
+    }
+
+    void prefetch(int index) {
+        QSet<QString> wanted;
+        for (int i = index - prefetchRadius; i <= index + prefetchRadius; ++i) {
+            if (i >= 0 && i < imageFiles.size()) {
+                wanted.insert(imageKey(i));
+            }
+        }
+        session->retain(this, wanted);
+        for (int distance = 0; distance <= prefetchRadius; ++distance) {
+            int priority = prefetchRadius - distance;
+            int neighbours[] = { index + distance, index - distance };
+            for (int k = 0; k < (distance > 0 ? 2 : 1); ++k) {
+                int i = neighbours[k];
+                if (i < 0 || i >= imageFiles.size() || isDeepZoomPath(imageFiles[i].name)) {
+                    continue;
+                }
+                QString key = imageKey(i);
+                if (!textureCache.contains(key) && !imageCache.contains(key)) {
+                    DecodeRequest request;
+                    request.key = key;
+                    request.path = imagePath(i);
+                    request.targetSize = decodeTargetSize();
+                    request.priority = priority;
+                    if (thumbnails.isEnabled() && !thumbnails.contains(thumbnailKey(i))) {
+                        request.thumbnailKey = thumbnailKey(i);
+                    }
+                    if (compressTextures && request.targetSize.isValid()) {
+                        int level = compressedTextureLevel(request.targetSize);
+                        request.targetSize = QSize(1 << level, 1 << level);
+                        request.compressedKey = compressedKey(i, level);
+                        request.compressedRecord = session->compressedTextures.find(request.compressedKey);
+                    }
+                    loader.request(request);
+                }
+            }
+        }
+        session->readahead.clearQueue();
+        for (int n = 1; n <= readaheadCount; ++n) {
+            int i = index + navigationStep * (prefetchRadius + n);
+            if (i < 0 || i >= imageFiles.size()) {
+                break;
+            }
+            session->readahead.request(imagePath(i), imageFiles[i].size);
+        }
+    }
+
+    QSize decodeTargetSize() const {
+        if (!reducedDecode || width() <= 0 || height() <= 0) {
+            return QSize();
+        }
+        return size() * devicePixelRatioF();
+    }
+
+    void refineIfNeeded() {
+        if (displayedKey != currentKey || displayedPreview || !sourceSizes.contains(currentKey)
+            || currentImageIndex < 0 || currentImageIndex >= imageFiles.size()) {
+            return;
+        }
+        int shownWidth = tiledTexture.isActive() ? tiledTexture.image().width() : (texture ? texture->width() : 0);
+        if (shownWidth <= 0 || shownWidth >= sourceSizes.value(currentKey).width()) {
+            return;
+        }
+        qreal neededWidth = imageBounds().width() / 2.0 * width() * devicePixelRatioF();
+        if (neededWidth > shownWidth * 1.05) {
+            DecodeRequest request;
+            request.key = currentKey;
+            request.path = imagePath(currentImageIndex);
+            request.priority = prefetchRadius + 1;
+            loader.request(request);
+        }
+    }
+
+    // Called for every decode finished in the session, after the shared
+    // caches were updated; only what this window waits for is shown.
+    void imageDecoded(const DecodeRequest& request, const DecodedImage& decoded) {
+        bool current = request.key == currentKey;
+        if (request.preview && request.key == scrubPendingKey) {
+            scrubPendingKey.clear();
+            if (scrubbing && !current && !currentHasImage) {
+                requestScrubPreview();
+            }
+        }
+        if (current && !decoded.image.isNull()) {
+            stats.decodeMs = decoded.decodeMs;
+        }
+        if (comparedKeys.contains(request.key)) {
+            update();
+            return;
+        }
+        if (request.cell) {
+            cellDecoded(request, decoded);
+            return;
+        }
+        if (request.preview) {
+            if (current && !currentHasImage && !decoded.image.isNull()) {
+                image = decoded.image;
+                imageBottomUp = false;
+                imageMapped = decoded.mapped;
+                updateTexture(false);
+                update();
+            }
+            return;
+        }
+        if (decoded.image.isNull() && decoded.compressed.isNull()) {
+            if (current) {
+                window()->close();
+            }
+            return;
+        }
+        if (decoded.animated && current) {
+            startAnimation();
+        }
+        DecodedImage* cached = imageCache.object(request.key);
+        if (cached && decodedWidth(*cached) > decodedWidth(decoded)) {
+            return;
+        }
+        if (current) {
+            currentHasImage = true;
+            showImage(decoded);
+        }
+    }
+
+    void showImage(const DecodedImage& decoded) {
+        if (!decoded.compressed.isNull()) {
+            showCompressed(decoded.compressed);
+            return;
+        }
+        image = decoded.image;
+        imageBottomUp = decoded.bottomUp;
+        imageMapped = decoded.mapped;
+        updateTexture();
+        update();
+    }
+
+    // Compressed blocks are small enough to go up in one call and replace
+    // any preview upload still pending for the image.
+    void showCompressed(const CompressedTexture& compressed) {
+        makeCurrent();
+        dropUploads(currentKey);
+        QOpenGLTexture* target = compressed.size.width() <= maxTextureSize && compressed.size.height() <= maxTextureSize
+            ? acquireTexture(compressed.size, compressed.alpha ? QOpenGLTexture::RGBA_DXT5 : QOpenGLTexture::RGB_DXT1, false)
+            : nullptr;
+        if (!target) {
+            doneCurrent();
+            return;
+        }
+        target->setWrapMode(QOpenGLTexture::ClampToEdge);
+        target->setCompressedData(0, compressed.blocks.size(), compressed.blocks.constData());
+        recycleTexture(uncachedTexture);
+        uncachedTexture = nullptr;
+        tiledTexture.clear();
+        QOpenGLTexture* replaced = textureCache.take(currentKey);
+        if (!textureCache.insert(currentKey, target, textureBytes(target))) {
+            uncachedTexture = target;
+        }
+        session->replaceTexture(replaced, uncachedTexture == target ? nullptr : target);
+        texture = target;
+        imageSize = sourceSizes.value(currentKey, compressed.size);
+        displayedKey = currentKey;
+        pinDisplayed(displayedKey);
+        displayedPreview = false;
+        doneCurrent();
+        refineIfNeeded();
+        update();
+    }
+
+    void showCachedTexture() {
+        makeCurrent();
+        recycleTexture(uncachedTexture);
+        uncachedTexture = nullptr;
+        tiledTexture.clear();
+        texture = textureCache.object(currentKey);
+        imageSize = sourceSizes.value(currentKey, QSize(texture->width(), texture->height()));
+        displayedKey = currentKey;
+        pinDisplayed(displayedKey);
+        displayedPreview = false;
+        doneCurrent();
+        scheduleMipmaps();
+        update();
+    }
+
+
+    QString imagePath(int index) const {
+        return directory + '/' + imageFiles[index].name;
+    }
+
+    QString imageKey(int index) const {
+        return cacheKey(imagePath(index), imageFiles[index].modified);
+    }
+
+    QString thumbnailKey(int index) const {
+        return imageKey(index) + '@' + QString::number(imageFiles[index].size);
+    }
+
+    QString compressedKey(int index, int level) const {
+        return thumbnailKey(index) + QString("#bc@%1").arg(1 << level);
+    }
+
+    void updateTitle() {
+        window()->setWindowTitle(QString("%1 (%2/%3%4)").arg(imageFiles[currentImageIndex].name).arg(currentImageIndex + 1)
+            .arg(imageFiles.size()).arg(scanning ? "+" : ""));
+    }
+
+    void entriesFound(const QVector<ImageEntry>& batch, bool finished) {
+        scanning = !finished;
+        if (!batch.isEmpty()) {
+            QString currentName = currentImageIndex >= 0 ? imageFiles[currentImageIndex].name : QString();
+            QString selectedName = gridMode ? imageFiles[gridSelection].name : QString();
+            QVector<ImageEntry> sorted = batch;
+            std::sort(sorted.begin(), sorted.end());
+            int middle = imageFiles.size();
+            imageFiles += sorted;
+            std::inplace_merge(imageFiles.begin(), imageFiles.begin() + middle, imageFiles.end());
+            if (currentImageIndex >= 0) {
+                ImageEntry current;
+                current.name = currentName;
+                currentImageIndex = static_cast<int>(std::lower_bound(imageFiles.begin(), imageFiles.end(), current) - imageFiles.begin());
+            }
+            if (gridMode) {
+                ImageEntry selected;
+                selected.name = selectedName;
+                gridSelection = static_cast<int>(std::lower_bound(imageFiles.begin(), imageFiles.end(), selected) - imageFiles.begin());
+                requestGridCells();
+                update();
+            }
+        }
+        if (imageFiles.isEmpty()) {
+            if (finished) {
+                window()->close();
+            }
+            return;
+        }
+        if (currentImageIndex < 0) {
+            if (initialized) {
+                loadImage(0);
+            }
+        } else {
+            updateTitle();
+        }
+    }
+
+    // Stream frames replace each other under one key and skip the texture
+    // cache; an upload still pending for an older frame is abandoned.
+    void streamFrameArrived(const QImage& frame, bool finished) {
+        if (finished) {
+            if (streamFrames == 0) {
+                window()->close();
+            }
+            return;
+        }
+        ++streamFrames;
+        window()->setWindowTitle(QString("stdin (%1, %2 dropped)").arg(streamFrames).arg(stream.droppedFrames()));
+        image = frame;
+        imageBottomUp = false;
+        imageMapped = false;
+        sourceSizes.insert(currentKey, frame.size());
+        if (!initialized) {
+            return;
+        }
+        makeCurrent();
+        dropUploads(currentKey);
+        doneCurrent();
+        updateTexture(false);
+        update();
+    }
+
+public:
+    bool isOpen() const {
+        return opened;
+    }
+
+    // Switches the window to another file or directory, keeping the GL
+    // context, shaders and caches warm. Used by the resident server.
+    bool openPath(const QString& path) {
+        QDir dir(path);
+        QFileInfo fileInfo(path);
+        if (!dir.exists() && !fileInfo.isFile()) {
+            return false;
+        }
+        openedPath = path;
+        makeCurrent();
+        closeCompare();
+        doneCurrent();
+        closePyramid();
+        scanner.cancel();
+        session->retain(this, QSet<QString>());
+        stopAnimation();
+        gridMode = false;
+        gridScroll = 0;
+        gridSelection = 0;
+        imageFiles.clear();
+        currentImageIndex = -1;
+        scanning = false;
+        if (dir.exists()) {
+            directory = dir.absolutePath();
+            scanning = true;
+            scanner.start(directory);
+            return true;
+        }
+        directory = fileInfo.absolutePath();
+        ImageEntry entry;
+        entry.name = fileInfo.fileName();
+        entry.modified = fileInfo.lastModified().toMSecsSinceEpoch();
+        entry.size = fileInfo.size();
+        imageFiles.append(entry);
+        if (initialized) {
+            loadImage(0);
+        }
+        return true;
+    }
+
+    // Shows the files side by side in one view, zoomed and panned together.
+    // They are decoded at full resolution through the shared pool and kept
+    // in the texture cache, so changing the reference costs nothing.
+    bool compare(const QStringList& paths) {
+        QStringList keys;
+        QStringList absolutePaths;
+        for (const QString& path : paths) {
+            QFileInfo fileInfo(path);
+            if (!fileInfo.isFile()) {
+                return false;
+            }
+            absolutePaths.append(fileInfo.absoluteFilePath());
+            keys.append(cacheKey(fileInfo.absoluteFilePath(), fileInfo.lastModified().toMSecsSinceEpoch()));
+        }
+        if (keys.isEmpty()) {
+            return false;
+        }
+        makeCurrent();
+        closeCompare();
+        doneCurrent();
+        closePyramid();
+        scanner.cancel();
+        stopAnimation();
+        cancelUploads();
+        gridMode = false;
+        imageFiles.clear();
+        currentImageIndex = -1;
+        currentKey.clear();
+        displayedKey.clear();
+        pinDisplayed(QString());
+        openedPath.clear();
+        scanning = false;
+        comparedPaths = absolutePaths;
+        comparedKeys = keys;
+        for (const QString& key : comparedKeys) {
+            textureCache.pin(key);
+        }
+        session->retain(this, QSet<QString>(comparedKeys.begin(), comparedKeys.end()));
+        compareReference = 0;
+        compareDifference = 0;
+        zoomLevel = 1.0f;
+        targetZoom = 1.0f;
+        panOffset = QPointF();
+        animationClock.invalidate();
+        updateCompareTitle();
+        update();
+        return true;
+    }
+
+private:
+    // A context must be current.
+    void closeCompare() {
+        for (const QString& key : comparedKeys) {
+            textureCache.unpin(key);
+            dropUploads(key);
+        }
+        for (QOpenGLTexture* owned : comparedOwned) {
+            recycleTexture(owned);
+        }
+        comparedOwned.clear();
+        comparedPaths.clear();
+        comparedKeys.clear();
+        comparedRequests.clear();
+    }
+
+    void stepReference(int step) {
+        int count = comparedKeys.size();
+        compareReference = ((compareReference + step) % count + count) % count;
+        updateCompareTitle();
+        update();
+    }
+
+    void updateCompareTitle() {
+        static const char* const views[] = { "", ", difference", ", amplified difference" };
+        window()->setWindowTitle(QString("%1 (reference %2/%3%4)").arg(QFileInfo(comparedPaths[compareReference]).fileName())
+            .arg(compareReference + 1).arg(comparedKeys.size()).arg(views[compareDifference]));
+    }
+
+    // One viewport per image, row by row from the top left, in a single
+    // pass; all of them use the same zoom and pan.
+    void drawCompare() {
+        glClear(GL_COLOR_BUFFER_BIT);
+        if (!shaderProgram || !shaderProgram->isLinked()) {
+            return;
+        }
+        QOpenGLTexture* reference = compareTexture(compareReference);
+        if (reference) {
+            imageSize = sourceSizes.value(comparedKeys[compareReference], QSize(reference->width(), reference->height()));
+        }
+        bool difference = compareDifference > 0 && reference && differenceProgram && differenceProgram->isLinked();
+
+        if (vertexArray.isCreated()) {
+            vertexArray.bind();
+        } else {
+            shaderProgram->bind();
+            bindQuadAttributes();
+        }
+        int columns = compareColumns();
+        int rows = compareRows();
+        int framebufferWidth = static_cast<int>(width() * devicePixelRatioF());
+        int framebufferHeight = static_cast<int>(height() * devicePixelRatioF());
+        int cellWidth = framebufferWidth / columns;
+        int cellHeight = framebufferHeight / rows;
+        for (int i = 0; i < comparedKeys.size(); ++i) {
+            QOpenGLTexture* drawn = i == compareReference ? reference : compareTexture(i);
+            if (!drawn) {
+                continue;
+            }
+            glViewport(i % columns * cellWidth, (rows - 1 - i / columns) * cellHeight, cellWidth, cellHeight);
+            QRectF bounds = imageBounds(sourceSizes.value(comparedKeys[i], QSize(drawn->width(), drawn->height())));
+            if (difference && i != compareReference) {
+                drawDifference(drawn, reference, bounds);
+            } else {
+                shaderProgram->bind();
+                drawQuad(drawn, bounds);
+            }
+        }
+        glViewport(0, 0, framebufferWidth, framebufferHeight);
+
+        if (vertexArray.isCreated()) {
+            vertexArray.release();
+        } else {
+            glDisableVertexAttribArray(positionLocation);
+            glDisableVertexAttribArray(texCoordLocation);
+        }
+        shaderProgram->release();
+    }
+
+    void drawDifference(QOpenGLTexture* drawn, QOpenGLTexture* reference, const QRectF& rect) {
+        QMatrix4x4 mvp;
+        mvp.translate(rect.center().x(), rect.center().y());
+        mvp.scale(rect.width() / 2.0f, rect.height() / 2.0f, 1.0f);
+        differenceProgram->bind();
+        differenceProgram->setUniformValue("mvp", mvp);
+        differenceProgram->setUniformValue("imageGrayscale", static_cast<GLint>(drawn->format() == QOpenGLTexture::R8_UNorm));
+        differenceProgram->setUniformValue("referenceGrayscale", static_cast<GLint>(reference->format() == QOpenGLTexture::R8_UNorm));
+        differenceProgram->setUniformValue("gain", compareDifference > 1 ? amplifiedDifferenceGain : 1.0f);
+        reference->bind(1, QOpenGLTexture::ResetTextureUnit);
+        drawn->bind();
+        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+    }
+
+    // The texture of a compared image: the one this window keeps when it did
+    // not fit the texture cache, else the cached one. When the image cache
+    // holds something sharper it is queued for upload, and the old texture
+    // is drawn until the upload completes. Called from paintGL().
+    QOpenGLTexture* compareTexture(int slot) {
+        const QString& key = comparedKeys[slot];
+        QOpenGLTexture* shown = comparedOwned.value(key, nullptr);
+        if (!shown) {
+            shown = textureCache.object(key);
+        }
+        DecodedImage* decoded = imageCache.object(key);
+        if ((!decoded || decodedWidth(*decoded) < sourceSizes.value(key).width()) && !comparedRequests.contains(key)) {
+            comparedRequests.insert(key);
+            DecodeRequest request;
+            request.key = key;
+            request.path = comparedPaths[slot];
+            request.priority = prefetchRadius + 2;
+            loader.request(request);
+        }
+        if (!decoded || (shown && shown->width() >= qMin(decodedWidth(*decoded), maxTextureSize))) {
+            return shown;
+        }
+        for (const PendingUpload& upload : uploads) {
+            if (upload.key == key) {
+                return shown;
+            }
+        }
+        if (!decoded->compressed.isNull()) {
+            QOpenGLTexture* uploaded = uploadCompressedCompared(decoded->compressed);
+            if (uploaded) {
+                keepCompared(key, uploaded);
+                return uploaded;
+            }
+            return shown;
+        }
+        queueCompared(key, *decoded);
+        return shown;
+    }
+
+    // Window-sized blocks, small enough to upload at once.
+    QOpenGLTexture* uploadCompressedCompared(const CompressedTexture& compressed) {
+        if (compressed.size.width() > maxTextureSize || compressed.size.height() > maxTextureSize) {
+            return nullptr;
+        }
+        QOpenGLTexture* target = acquireTexture(compressed.size, compressed.alpha ? QOpenGLTexture::RGBA_DXT5 : QOpenGLTexture::RGB_DXT1, false);
+        if (target) {
+            target->setWrapMode(QOpenGLTexture::ClampToEdge);
+            target->setCompressedData(0, compressed.blocks.size(), compressed.blocks.constData());
+        }
+        return target;
+    }
+
+    // Through the pixel buffers like any other upload, with mipmaps, scaled
+    // down only where the image exceeds the largest texture the driver takes.
+    void queueCompared(const QString& key, const DecodedImage& decoded) {
+        QImage source = decoded.image;
+        if (source.width() > maxTextureSize || source.height() > maxTextureSize) {
+            source = source.scaled(maxTextureSize, maxTextureSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+        }
+        QImage uploadable = uploadableImage(source);
+        if (!bgraSupported) {
+            uploadable = rgbOrderedImage(uploadable);
+        }
+        PixelTransfer transfer;
+        pixelTransfer(uploadable.format(), redTexturesSupported, &transfer);
+        QOpenGLTexture* target = acquireTexture(uploadable.size(), transfer.textureFormat, true);
+        if (!target) {
+            return;
+        }
+        target->setWrapMode(QOpenGLTexture::ClampToEdge);
+        PendingUpload upload;
+        upload.key = key;
+        upload.image = uploadable;
+        upload.texture = target;
+        upload.nextRow = 0;
+        upload.cacheable = true;
+        upload.bottomUp = decoded.bottomUp;
+        upload.mipmapped = true;
+        upload.queued.start();
+        uploads.append(upload);
+        update();
+    }
+
+    // A sharper texture of a compared image goes into the texture cache;
+    // when the budget refuses it (it is larger than the budget, or pinned
+    // textures fill it) the window keeps it and the cached one stays.
+    void keepCompared(const QString& key, QOpenGLTexture* uploaded) {
+        QOpenGLTexture* owned = comparedOwned.take(key);
+        QOpenGLTexture* replaced = textureCache.take(key);
+        if (textureCache.insert(key, uploaded, textureBytes(uploaded))) {
+            session->replaceTexture(replaced, uploaded);
+        } else {
+            comparedOwned.insert(key, uploaded);
+            if (replaced && !textureCache.insert(key, replaced, textureBytes(replaced))) {
+                session->replaceTexture(replaced, nullptr);
+            }
+        }
+        recycleTexture(owned);
+        update();
+    }
+
+
+    // Moves by step, clamped to the list; only the image landed on is read.
+    void stepImage(int step, bool repeated) {
+        if (currentImageIndex < 0 || imageFiles.isEmpty()) {
+            return;
+        }
+        int index = qBound(0, currentImageIndex + step, imageFiles.size() - 1);
+        if (index == currentImageIndex) {
+            return;
+        }
+        if (repeated) {
+            scrubTo(index);
+        } else {
+            loadImage(index);
+        }
+    }
+
+    // While a navigation key auto-repeats, only what is at hand is shown: a
+    // cached texture or decode, else the stored or EXIF thumbnail, fetched
+    // one at a time so the images passed while one is in flight are never
+    // read. The full decode and prefetch wait for the key's release.
+    void scrubTo(int index) {
+        scrubbing = true;
+        navigationStep = index < currentImageIndex ? -1 : 1;
+        currentImageIndex = index;
+        updateTitle();
+        currentKey = imageKey(index);
+        currentHasImage = false;
+        zoomLevel = 1.0f;
+        targetZoom = 1.0f;
+        panOffset = QPointF();
+        animationClock.invalidate();
+        if (animationKey != currentKey) {
+            stopAnimation();
+        }
+        cancelUploads();
+        closePyramid();
+        session->retain(this, scrubPendingKey.isEmpty() ? QSet<QString>() : QSet<QString>() << scrubPendingKey);
+        if (textureCache.contains(currentKey)) {
+            currentHasImage = true;
+            showCachedTexture();
+        } else if (DecodedImage* cached = imageCache.object(currentKey)) {
+            currentHasImage = true;
+            showImage(*cached);
+        } else if (scrubPendingKey.isEmpty()) {
+            requestScrubPreview();
+        }
+    }
+
+    void requestScrubPreview() {
+        if (isDeepZoomPath(imageFiles[currentImageIndex].name)) {
+            return;
+        }
+        DecodeRequest request;
+        request.key = currentKey;
+        request.path = imagePath(currentImageIndex);
+        request.preview = true;
+        request.thumbnail = thumbnails.find(thumbnailKey(currentImageIndex));
+        request.priority = prefetchRadius + 2;
+        scrubPendingKey = currentKey;
+        session->retain(this, QSet<QString>() << currentKey);
+        loader.request(request);
+    }
+
+    void updateTexture(bool cacheable = true, bool mipmapped = false) {
+        if (image.isNull()) {
+            return;
+        }
+        makeCurrent();
+        for (int i = 0; i < uploads.size(); ++i) {
+            if (uploads[i].key == currentKey) {
+                if (uploads[i].image.size() == image.size() && uploads[i].cacheable == cacheable && uploads[i].mipmapped == mipmapped) {
+                    doneCurrent();
+                    return;
+                }
+                recycleTexture(uploads[i].texture);
+                uploads.removeAt(i);
+                break;
+            }
+        }
+        PixelTransfer transfer;
+        QImage uploadable = uploadableImage(image);
+        if (!bgraSupported) {
+            uploadable = rgbOrderedImage(uploadable);
+        }
+        pixelTransfer(uploadable.format(), redTexturesSupported, &transfer);
+        if (image.width() > maxTextureSize || image.height() > maxTextureSize) {
+            recycleTexture(uncachedTexture);
+            uncachedTexture = nullptr;
+            texture = nullptr;
+            tiledTexture.reset(currentKey, uploadable, imageBottomUp);
+            imageSize = sourceSizes.value(currentKey, image.size());
+            displayedKey = currentKey;
+            displayedPreview = false;
+            pinDisplayed(displayedKey);
+            doneCurrent();
+            return;
+        }
+        QOpenGLTexture* target = acquireTexture(image.size(), transfer.textureFormat, mipmapped);
+        if (target) {
+            PendingUpload upload;
+            upload.key = currentKey;
+            upload.image = uploadable;
+            upload.texture = target;
+            upload.nextRow = 0;
+            upload.cacheable = cacheable;
+            upload.bottomUp = imageBottomUp;
+            upload.mipmapped = mipmapped;
+            upload.queued.start();
+            uploads.append(upload);
+        }
+        doneCurrent();
+    }
+
+    QOpenGLTexture* acquireTexture(const QSize& size, QOpenGLTexture::TextureFormat format, bool mipmapped) {
+        return session->acquireTexture(size, format, mipmapped);
+    }
+
+    void recycleTexture(QOpenGLTexture* unused) {
+        session->recycleTexture(unused);
+    }
+
+    void cancelUploads() {
+        makeCurrent();
+        QList<PendingUpload>::iterator it = uploads.begin();
+        while (it != uploads.end()) {
+            if (it->key == currentKey) {
+                ++it;
+            } else {
+                recycleTexture(it->texture);
+                it = uploads.erase(it);
+            }
+        }
+        doneCurrent();
+    }
+
+    void dropUploads(const QString& key) {
+        for (int i = uploads.size() - 1; i >= 0; --i) {
+            if (uploads[i].key == key) {
+                recycleTexture(uploads.takeAt(i).texture);
+            }
+        }
+    }
+
+    bool pumpUploads() {
+        qint64 budget = uploadBytesPerFrame;
+        while (!uploads.isEmpty() && budget > 0) {
+            PendingUpload& upload = uploads.first();
+            int bytesPerLine = upload.image.bytesPerLine();
+            int rows = static_cast<int>(qBound<qint64>(1, budget / bytesPerLine, upload.image.height() - upload.nextRow));
+            QRect region(0, upload.nextRow, upload.image.width(), rows);
+            uploadRegion(upload.texture, upload.image, upload.bottomUp, region, region.topLeft());
+            upload.nextRow += rows;
+            budget -= static_cast<qint64>(rows) * bytesPerLine;
+            if (upload.nextRow >= upload.image.height()) {
+                finishUpload(uploads.takeFirst());
+            }
+        }
+        return !uploads.isEmpty();
+    }
+
+    void uploadRegion(QOpenGLTexture* target, const QImage& source, bool bottomUp, const QRect& region, const QPoint& offset) {
+        PixelTransfer transfer;
+        pixelTransfer(source.format(), redTexturesSupported, &transfer);
+        GLenum pixelFormat = static_cast<GLenum>(transfer.format);
+        GLenum pixelType = static_cast<GLenum>(transfer.type);
+        int rowBytes = region.width() * transfer.bytesPerPixel;
+        int stride = bottomUp ? -source.bytesPerLine() : source.bytesPerLine();
+        int firstRow = bottomUp ? source.height() - 1 - region.top() : region.top();
+        const uchar* first = source.constScanLine(firstRow) + region.left() * transfer.bytesPerPixel;
+        target->bind();
+        glPixelStorei(GL_UNPACK_ALIGNMENT, rowBytes % 4 == 0 ? 4 : 1);
+        if (pixelBuffersSupported) {
+            QOpenGLBuffer& pixelBuffer = pixelBuffers[pixelBufferIndex];
+            pixelBufferIndex = (pixelBufferIndex + 1) % pixelBufferCount;
+            pixelBuffer.bind();
+            pixelBuffer.allocate(rowBytes * region.height());
+            uchar* mapped = static_cast<uchar*>(pixelBuffer.map(QOpenGLBuffer::WriteOnly));
+            if (mapped) {
+                if (rowBytes == stride) {
+                    memcpy(mapped, first, rowBytes * region.height());
+                } else {
+                    for (int y = 0; y < region.height(); ++y) {
+                        memcpy(mapped + y * rowBytes, first + y * stride, rowBytes);
+                    }
+                }
+                pixelBuffer.unmap();
+                glTexSubImage2D(GL_TEXTURE_2D, 0, offset.x(), offset.y(), region.width(), region.height(), pixelFormat, pixelType, nullptr);
+                pixelBuffer.release();
+                return;
+            }
+            pixelBuffer.release();
+        }
+        if (rowBytes == stride) {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, offset.x(), offset.y(), region.width(), region.height(), pixelFormat, pixelType, first);
+        } else if (stride > 0 && unpackRowLengthSupported && stride % transfer.bytesPerPixel == 0) {
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, stride / transfer.bytesPerPixel);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, offset.x(), offset.y(), region.width(), region.height(), pixelFormat, pixelType, first);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        } else {
+            for (int y = 0; y < region.height(); ++y) {
+                glTexSubImage2D(GL_TEXTURE_2D, 0, offset.x(), offset.y() + y, region.width(), 1, pixelFormat, pixelType, first + y * stride);
+            }
+        }
+    }
+
+    void finishUpload(const PendingUpload& upload) {
+        if (upload.mipmapped) {
+            upload.texture->generateMipMaps();
+        }
+        if (comparedKeys.contains(upload.key)) {
+            stats.uploadMs = elapsedMilliseconds(upload.queued);
+            keepCompared(upload.key, upload.texture);
+            return;
+        }
+        if (upload.key != currentKey) {
+            recycleTexture(upload.texture);
+            return;
+        }
+        stats.uploadMs = elapsedMilliseconds(upload.queued);
+        recycleTexture(uncachedTexture);
+        uncachedTexture = nullptr;
+        tiledTexture.clear();
+        if (upload.cacheable) {
+            QOpenGLTexture* replaced = textureCache.take(upload.key);
+            if (!textureCache.insert(upload.key, upload.texture, textureBytes(upload.texture))) {
+                uncachedTexture = upload.texture;
+            }
+            session->replaceTexture(replaced, uncachedTexture == upload.texture ? nullptr : upload.texture);
+        } else {
+            uncachedTexture = upload.texture;
+        }
+        texture = upload.texture;
+        imageSize = sourceSizes.value(upload.key, upload.image.size());
+        displayedKey = upload.key;
+        pinDisplayed(displayedKey);
+        displayedPreview = !upload.cacheable;
+        // Later re-uploads and mipmap rebuilds use the cache's copy rather
+        // than the mapping of a file that may change on disk.
+        DecodedImage* cached = imageMapped ? imageCache.object(upload.key) : nullptr;
+        if (cached && !cached->mapped && cached->image.size() == image.size()) {
+            image = cached->image;
+            imageMapped = false;
+        }
+        refineIfNeeded();
+        scheduleMipmaps();
+    }
+
+    QImage image;
+    bool imageBottomUp;
+    bool imageMapped;
+    QSize imageSize;
+    QOpenGLShaderProgram*& shaderProgram;
+    QOpenGLTexture* texture;
+    QOpenGLTexture* uncachedTexture;
+    GLuint& VBO;
+    GLuint& EBO;
+    QOpenGLVertexArrayObject vertexArray;
+    GLint positionLocation, texCoordLocation;
+    GLint mvpLocation, grayscaleLocation, downscaleLocation, texelSizeLocation, scaleLocation;
+    QuadUniforms& quadUniforms;
+    QOpenGLShaderProgram*& gridProgram;
+    QOpenGLBuffer gridBuffer;
+    QOpenGLBuffer& gridCornerBuffer;
+    QOpenGLShaderProgram*& differenceProgram;
+    GLint gridCornerLocation, gridCellRectLocation, gridAtlasRectLocation, gridAtlasIndexLocation;
+    ThumbnailAtlas thumbnailAtlas;
+    QSet<QString> failedCells;
+    bool gridMode;
+    int gridScroll;
+    int gridSelection;
+    float zoomLevel;
+    float targetZoom;
+    QPointF panOffset;
+    QPointF zoomAnchor;
+    QPoint dragPosition;
+    QStringList comparedPaths;
+    QStringList comparedKeys;
+    // Compared keys already asked for at full resolution; not retried.
+    QSet<QString> comparedRequests;
+    // Textures of compared images that did not fit the texture cache, owned
+    // by this window until the comparison closes.
+    QHash<QString, QOpenGLTexture*> comparedOwned;
+    int compareReference;
+    // 0 shows the images, 1 their difference to the reference, 2 the
+    // difference amplified.
+    int compareDifference;
+    bool dragging;
+    QElapsedTimer animationClock;
+    AnimationPlayer animation;
+    QString animationKey;
+    QSet<QString>& animatedKeys;
+    QList<UploadedFrame> uploadedFrames;
+    QList<QOpenGLTexture*> spareFrameTextures;
+    QOpenGLTexture* shownFrame;
+    int shownFrameDelay;
+    QElapsedTimer frameClock;
+    QString directory;
+    QVector<ImageEntry> imageFiles;
+    bool scanning;
+    bool initialized;
+    int currentImageIndex;
+    int prefetchRadius;
+    int readaheadCount;
+    // Direction of the last move through imageFiles, which readahead follows.
+    int navigationStep;
+    // A navigation key is auto-repeating; see scrubTo().
+    bool scrubbing;
+    // Preview in flight for scrubbing, at most one at a time.
+    QString scrubPendingKey;
+    bool reducedDecode;
+    QString currentKey;
+    QString displayedKey;
+    bool displayedPreview;
+    bool currentHasImage;
+    QHash<QString, QSize>& sourceSizes;
+    QCache<QString, DecodedImage>& imageCache;
+    TextureCache& textureCache;
+    TiledTexture tiledTexture;
+    // The current image when it is a deep-zoom pyramid; only tiles of the
+    // level the zoom needs, in view, are decoded and kept.
+    DeepZoomPyramid pyramid;
+    TextureCache pyramidTiles;
+    QSet<QString> failedPyramidTiles;
+    ImageLoader tileLoader;
+    GLint maxTextureSize;
+    QList<PendingUpload> uploads;
+    static const int pixelBufferCount = 3;
+    static const qint64 uploadBytesPerFrame = Q_INT64_C(32) << 20;
+    static const int timerQueryCount = 3;
+    static constexpr double zoomTimeConstant = 0.06;
+    static const int gridCellSize = 160;
+    // Images skipped by PageUp and PageDown.
+    static const int pageImages = 10;
+    static const int gridPadding = 16;
+    static const int gridPrefetchRows = 2;
+    static const int frameTextureCount = 3;
+    QOpenGLBuffer pixelBuffers[pixelBufferCount];
+    int pixelBufferIndex;
+#ifndef QT_OPENGL_ES_2
+    QList<QOpenGLTimerQuery*> timerQueries;
+    QSet<int> pendingTimerQueries;
+#endif
+    int timerQueryIndex;
+    bool hudVisible;
+    HudStatistics stats;
+    bool pixelBuffersSupported;
+    bool unpackRowLengthSupported;
+    bool redTexturesSupported;
+    bool bgraSupported;
+    bool instancingSupported;
+    bool compressTextures;
+    ImageLoader& loader;
+    DirectoryScanner scanner;
+    ThumbnailStore& thumbnails;
+    StdinStream stream;
+    bool streaming;
+    int streamFrames;
+    QSharedPointer<ViewerSession> session;
+    bool sharesGL;
+    // False when the path or image the window was created for could not
+    // be shown, so the caller can drop the window instead of quitting.
+    bool opened;
+    QString pinnedKey;
+    QString openedPath;
+};
+
+class ImageViewer : public QMainWindow {
+    Q_OBJECT
+public:
+    ImageViewer(const QString& path, const QSharedPointer<ViewerSession>& session, QWidget* parent = nullptr)
+        : QMainWindow(parent) {
+        setWindowTitle(QFileInfo(path).fileName());
+        resize(800, 600);
+
+        ImageGLWidget* glWidget = new ImageGLWidget(path, session, this);
+        setCentralWidget(glWidget);
+    }
+
+    ImageViewer(const QImage& clipboardImage, const QSharedPointer<ViewerSession>& session, QWidget* parent = nullptr)
+        : QMainWindow(parent) {
+        setWindowTitle("grxiv");
+        resize(800, 600);
+
+        ImageGLWidget* glWidget = new ImageGLWidget(clipboardImage, session, this);
+        setCentralWidget(glWidget);
+    }
 
-        QDir dir(path);
-        if (dir.exists()) {
-            QStringList filters;
-            filters << "*.jpg" << "*.jpeg" << "*.png" << "*.bmp" << "*.gif";
-            dir.setNameFilters(filters);
-            dir.setFilter(QDir::Files | QDir::NoDotAndDotDot);
-            dir.setSorting(QDir::Name);
-            imageFiles = dir.entryInfoList();
-            if (imageFiles.isEmpty()) {
-                QApplication::quit();
-                return;
-            }
-        } else {
-            QFileInfo fileInfo(path);
-            if (fileInfo.isFile()) {
-                imageFiles << fileInfo;
-            } else {
-                QApplication::quit();
-                return;
+    explicit ImageViewer(const QSharedPointer<ViewerSession>& session, QWidget* parent = nullptr)
+        : QMainWindow(parent) {
+        setWindowTitle("stdin");
+        resize(800, 600);
+
+        ImageGLWidget* glWidget = new ImageGLWidget(session, this);
+        setCentralWidget(glWidget);
+    }
+
+    bool openPath(const QString& path) {
+        return static_cast<ImageGLWidget*>(centralWidget())->openPath(path);
+    }
+
+    bool isOpen() const {
+        return static_cast<ImageGLWidget*>(centralWidget())->isOpen();
+    }
+
+    bool compare(const QStringList& paths) {
+        return static_cast<ImageGLWidget*>(centralWidget())->compare(paths);
+    }
+};
+
+// Opens another window on path, on the next monitor when there are several.
+// Windows are deleted when closed, or at the latest when the application
+// quits, so the session and its thumbnail store are released in order.
+static void openViewerWindow(ViewerSession* session, const QString& path, QWidget* from) {
+    ImageViewer* viewer = new ImageViewer(path, session->sharedFromThis());
+    if (!viewer->isOpen()) {
+        delete viewer;
+        return;
+    }
+    viewer->setAttribute(Qt::WA_DeleteOnClose);
+    QPointer<ImageViewer> guard(viewer);
+    QObject::connect(qApp, &QCoreApplication::aboutToQuit, qApp, [guard]() { delete guard.data(); });
+    QList<QScreen*> screens = QGuiApplication::screens();
+    QScreen* screen = from && from->windowHandle() ? from->windowHandle()->screen() : QGuiApplication::primaryScreen();
+    if (screens.size() > 1) {
+        viewer->move(screens[(screens.indexOf(screen) + 1) % screens.size()]->availableGeometry().topLeft());
+    } else if (from) {
+        viewer->move(from->pos() + QPoint(32, 32));
+    }
+    viewer->show();
+}
+
+// Socket of the resident viewer started with --server, private to the user:
+// in XDG_RUNTIME_DIR, or else in a 0700 directory of the user's own in the
+// shared temporary directory, where anyone could create the socket first.
+// Empty when that directory exists but belongs to someone else or is open
+// to others.
+static QString serverSocketPath() {
+    QString runtimeDirectory = QString::fromLocal8Bit(qgetenv("XDG_RUNTIME_DIR"));
+    if (!runtimeDirectory.isEmpty()) {
+        return runtimeDirectory + QString("/grxiv-%1.socket").arg(getuid());
+    }
+    QString directory = QDir::tempPath() + QString("/grxiv-%1").arg(getuid());
+    QByteArray encoded = QFile::encodeName(directory);
+    if (::mkdir(encoded.constData(), 0700) != 0 && errno != EEXIST) {
+        return QString();
+    }
+    struct stat status;
+    if (::lstat(encoded.constData(), &status) != 0 || !S_ISDIR(status.st_mode) || status.st_uid != getuid()
+        || (status.st_mode & 077) != 0) {
+        return QString();
+    }
+    return directory + "/server.socket";
+}
+
+// Whether the process at the other end of a Unix socket runs as this user.
+static bool peerIsCurrentUser(int descriptor) {
+#ifdef SO_PEERCRED
+    ucred credentials;
+    socklen_t length = sizeof(credentials);
+    return ::getsockopt(descriptor, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0 && credentials.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    return ::getpeereid(descriptor, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+static const int serverReplyTimeoutMs = 2000;
+
+// Hands path to a running server before any Qt or GL setup. Returns the
+// exit status (0 shown, 1 rejected), or -1 when no server answered.
+static int forwardToServer(const QString& path) {
+    QByteArray socketPath = QFile::encodeName(serverSocketPath());
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.isEmpty() || socketPath.size() >= static_cast<int>(sizeof(address.sun_path))) {
+        return -1;
+    }
+    memcpy(address.sun_path, socketPath.constData(), socketPath.size());
+    int descriptor = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (descriptor < 0) {
+        return -1;
+    }
+    int result = -1;
+    if (::connect(descriptor, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0 && peerIsCurrentUser(descriptor)) {
+        QByteArray request = QFileInfo(path).absoluteFilePath().toUtf8() + '\n';
+        if (::send(descriptor, request.constData(), request.size(), MSG_NOSIGNAL) == request.size()) {
+            pollfd reply = { descriptor, POLLIN, 0 };
+            char status = 0;
+            if (::poll(&reply, 1, serverReplyTimeoutMs) > 0 && ::read(descriptor, &status, 1) == 1) {
+                result = status == '+' ? 0 : 1;
             }
         }
     }
+    ::close(descriptor);
+    return result;
+}
 
-    ImageGLWidget(const QImage& clipboardImage, QWidget* parent = nullptr)
-        : QOpenGLWidget(parent), shaderProgram(nullptr), texture(nullptr), zoomLevel(1.0f), currentImageIndex(0) {
-        QSurfaceFormat format;
-        format.setVersion(2, 1);
-        format.setProfile(QSurfaceFormat::CompatibilityProfile);
-        setFormat(format);
-        setFocusPolicy(Qt::StrongFocus);
+// Keeps one viewer window with its GL context, shaders and caches alive and
+// shows every path handed over the socket in it. Closing the window only
+// hides it, so the next request paints without any initialisation.
+static int runServer(QApplication& app, const QSharedPointer<ViewerSession>& session, const QString& initialPath) {
+    QString socketPath = serverSocketPath();
+    if (socketPath.isEmpty()) {
+        QTextStream(stderr) << "grxiv: no private directory for the server socket\n";
+        return 1;
+    }
+    QLocalSocket probe;
+    probe.connectToServer(socketPath);
+    if (probe.waitForConnected(100)) {
+        return 1;
+    }
+    QLocalServer::removeServer(socketPath);
+    QLocalServer server;
+    server.setSocketOptions(QLocalServer::UserAccessOption);
+    if (!server.listen(socketPath)) {
+        return 1;
+    }
+    app.setQuitOnLastWindowClosed(false);
 
-        image = clipboardImage;
-        if (image.isNull()) {
-            QApplication::quit();
-            return;
+    QScopedPointer<ImageViewer> viewer;
+    auto show = [&viewer, session](const QString& path) {
+        if (!QFileInfo::exists(path)) {
+            return false;
+        }
+        if (!viewer) {
+            viewer.reset(new ImageViewer(path, session));
+            if (!viewer->isOpen()) {
+                viewer.reset();
+                return false;
+            }
+        } else if (!viewer->openPath(path)) {
+            return false;
+        }
+        viewer->show();
+        viewer->raise();
+        viewer->activateWindow();
+        return true;
+    };
+    QObject::connect(&server, &QLocalServer::newConnection, [&server, show]() {
+        while (QLocalSocket* client = server.nextPendingConnection()) {
+            if (!peerIsCurrentUser(static_cast<int>(client->socketDescriptor()))) {
+                client->abort();
+                client->deleteLater();
+                continue;
+            }
+            QObject::connect(client, &QLocalSocket::disconnected, client, &QObject::deleteLater);
+            QObject::connect(client, &QLocalSocket::readyRead, client, [client, show]() {
+                if (!client->canReadLine()) {
+                    return;
+                }
+                QByteArray line = client->readLine();
+                line.chop(1);
+                client->write(show(QString::fromUtf8(line)) ? "+" : "-");
+                client->flush();
+                client->disconnectFromServer();
+            });
         }
-        imageFiles << QFileInfo("clipboard_image");
+    });
+    if (!initialPath.isEmpty() && !show(initialPath)) {
+        return 1;
     }
+    return app.exec();
+}
 
-    ~ImageGLWidget() {
-        makeCurrent();
-        delete texture;
+struct BenchmarkSample {
+    enum Stage { Read, Decode, Convert, Upload, Mipmap, Paint, StageCount };
+
+    QString path;
+    QSize size;
+    double milliseconds[StageCount];
+};
+
+static const char* const benchmarkStageNames[BenchmarkSample::StageCount] = {
+    "read", "decode", "convert", "upload", "mipmap", "paint"
+};
+
+static double percentile(QVector<double> values, double rank) {
+    if (values.isEmpty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    int index = static_cast<int>(std::ceil(rank / 100.0 * values.size())) - 1;
+    return values[qBound(0, index, values.size() - 1)];
+}
+
+static QString csvField(const QString& text) {
+    if (!text.contains(',') && !text.contains('"') && !text.contains('\n')) {
+        return text;
+    }
+    return '"' + QString(text).replace("\"", "\"\"") + '"';
+}
+
+// An offscreen GL 2.1 context with the viewer's quad program, for the modes
+// that render without a window.
+class OffscreenRenderer : protected QOpenGLFunctions {
+public:
+    OffscreenRenderer()
+        : shaderProgram(nullptr), VBO(0), EBO(0), maxTextureSize(0), redTexturesSupported(false) {}
+
+    virtual ~OffscreenRenderer() {
+        if (!context.makeCurrent(&surface)) {
+            return;
+        }
         delete shaderProgram;
         glDeleteBuffers(1, &VBO);
         glDeleteBuffers(1, &EBO);
-        doneCurrent();
+        context.doneCurrent();
     }
 
-protected:
-    void initializeGL() override {
-        if (!context()) {
-            return;
+    bool initialize() {
+        QSurfaceFormat format;
+        format.setVersion(2, 1);
+        format.setProfile(QSurfaceFormat::CompatibilityProfile);
+        surface.setFormat(format);
+        surface.create();
+        context.setFormat(format);
+        if (!surface.isValid() || !context.create() || !context.makeCurrent(&surface)) {
+            return false;
         }
-
         initializeOpenGLFunctions();
 
-        shaderProgram = new QOpenGLShaderProgram(this);
-        if (!shaderProgram) {
-            return;
-        }
-
+        shaderProgram = new QOpenGLShaderProgram();
         bool success = true;
-        success &= shaderProgram->addShaderFromSourceCode(QOpenGLShader::Vertex,
-            "#version 120\n"
-            "attribute vec2 position;\n"
-            "attribute vec2 texCoord;\n"
-            "varying vec2 vTexCoord;\n"
-            "uniform mat4 mvp;\n"
-            "void main() {\n"
-            "    gl_Position = mvp * vec4(position, 0.0, 1.0);\n"
-            "    vTexCoord = texCoord;\n"
-            "}\n");
-        success &= shaderProgram->addShaderFromSourceCode(QOpenGLShader::Fragment,
-            "#version 120\n"
-            "varying vec2 vTexCoord;\n"
-            "uniform sampler2D tex;\n"
-            "void main() {\n"
-            "    gl_FragColor = texture2D(tex, vTexCoord);\n"
-            "}\n");
+        success &= shaderProgram->addShaderFromSourceCode(QOpenGLShader::Vertex, vertexShaderSource);
+        success &= shaderProgram->addShaderFromSourceCode(QOpenGLShader::Fragment, fragmentShaderSource);
         success &= shaderProgram->link();
         if (!success) {
-            return;
+            return false;
         }
 
-        float vertices[] = {
-            -1.0f, -1.0f, 0.0f, 1.0f,
-             1.0f, -1.0f, 1.0f, 1.0f,
-             1.0f,  1.0f, 1.0f, 0.0f,
-            -1.0f,  1.0f, 0.0f, 0.0f
-        };
-        unsigned int indices[] = {
-            0, 1, 2,
-            2, 3, 0
-        };
-
         glGenBuffers(1, &VBO);
-        if (VBO == 0) {
-            return;
-        }
         glGenBuffers(1, &EBO);
-        if (EBO == 0) {
-            return;
-        }
-
         glBindBuffer(GL_ARRAY_BUFFER, VBO);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-
+        glBufferData(GL_ARRAY_BUFFER, sizeof(quadVertices), quadVertices, GL_STATIC_DRAW);
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(quadIndices), quadIndices, GL_STATIC_DRAW);
 
-        if (!imageFiles.isEmpty()) {
-            if (image.isNull()) {
-                loadImage(0);
-            } else {
-                image = image.convertToFormat(QImage::Format_ARGB32);
-                updateTexture();
-            }
-        }
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+        redTexturesSupported = context.format().majorVersion() >= 3 || context.hasExtension("GL_ARB_texture_rg");
+        return true;
     }
 
-    void paintGL() override {
-        glClear(GL_COLOR_BUFFER_BIT);
-
-        if (!texture || !texture->isCreated() || !shaderProgram || !shaderProgram->isLinked()) {
-            return;
+protected:
+    // Fills the bound framebuffer, target pixels in size, with drawn. Without
+    // a mip chain minification goes through the Lanczos path of the fragment
+    // shader, as in the viewer.
+    void drawTexture(QOpenGLTexture* drawn, const QSize& target, bool bottomUp) {
+        qreal minification = static_cast<qreal>(drawn->width()) / target.width();
+        QMatrix4x4 mvp;
+        if (bottomUp) {
+            mvp.scale(1.0f, -1.0f);
         }
-
         shaderProgram->bind();
-
         glBindBuffer(GL_ARRAY_BUFFER, VBO);
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-
         GLint posLoc = shaderProgram->attributeLocation("position");
         GLint texLoc = shaderProgram->attributeLocation("texCoord");
         glVertexAttribPointer(posLoc, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
         glVertexAttribPointer(texLoc, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)(2 * sizeof(float)));
         glEnableVertexAttribArray(posLoc);
         glEnableVertexAttribArray(texLoc);
-
-        QMatrix4x4 mvp;
-        float imageAspect = static_cast<float>(image.width()) / image.height();
-        float windowAspect = static_cast<float>(width()) / height();
-        float scaleX = 1.0f;
-        float scaleY = 1.0f;
-
-        if (imageAspect > windowAspect) {
-            scaleY = windowAspect / imageAspect;
-        } else {
-            scaleX = imageAspect / windowAspect;
-        }
-
-        mvp.scale(scaleX * zoomLevel, scaleY * zoomLevel, 1.0f);
         shaderProgram->setUniformValue("mvp", mvp);
-
-        texture->bind();
+        shaderProgram->setUniformValue("grayscale", static_cast<GLint>(drawn->format() == QOpenGLTexture::R8_UNorm));
+        shaderProgram->setUniformValue("downscale", static_cast<GLint>(minification > 1.0 && drawn->mipLevels() <= 1));
+        shaderProgram->setUniformValue("texelSize", QVector2D(1.0f / drawn->width(), 1.0f / drawn->height()));
+        shaderProgram->setUniformValue("scale", static_cast<GLfloat>(qBound<qreal>(1.0, minification, maxShaderDownscale)));
+        drawn->bind();
         glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-
         glDisableVertexAttribArray(posLoc);
         glDisableVertexAttribArray(texLoc);
         shaderProgram->release();
     }
 
-    void resizeGL(int w, int h) override {
-        glViewport(0, 0, w, h);
-    }
+    QOffscreenSurface surface;
+    QOpenGLContext context;
+    QOpenGLShaderProgram* shaderProgram;
+    GLuint VBO, EBO;
+    GLint maxTextureSize;
+    bool redTexturesSupported;
+};
 
-    void wheelEvent(QWheelEvent* event) override {
-        float delta = event->angleDelta().y() > 0 ? 1.1f : 0.9f;
-        zoomLevel *= delta;
-        zoomLevel = qMax(0.1f, qMin(zoomLevel, 10.0f));
-        update();
+class PipelineBenchmark : public OffscreenRenderer {
+public:
+    PipelineBenchmark() : framebuffer(nullptr) {}
+
+    ~PipelineBenchmark() {
+        if (context.makeCurrent(&surface)) {
+            delete framebuffer;
+            context.doneCurrent();
+        }
     }
 
-    void keyPressEvent(QKeyEvent* event) override {
-        if (event->key() == Qt::Key_Q) {
-            window()->close();
-        } else if (event->key() == Qt::Key_Left) {
-            loadPreviousImage();
-        } else if (event->key() == Qt::Key_Right) {
-            loadNextImage();
+    bool initialize() {
+        if (!OffscreenRenderer::initialize()) {
+            return false;
         }
-        QOpenGLWidget::keyPressEvent(event);
+        framebuffer = new QOpenGLFramebufferObject(framebufferSize);
+        return framebuffer->isValid();
     }
 
-private:
-    void loadImage(int index) {
-        if (index < 0 || index >= imageFiles.size()) {
-            return;
+    // Runs every stage of the viewer pipeline on one file. GL stages end with
+    // glFinish() so that the driver's deferred work is charged to the stage
+    // that queued it; stages that were skipped are reported as -1.
+    BenchmarkSample measure(const QString& path) {
+        BenchmarkSample sample;
+        sample.path = path;
+        for (int i = 0; i < BenchmarkSample::StageCount; ++i) {
+            sample.milliseconds[i] = -1.0;
         }
-        currentImageIndex = index;
-        window()->setWindowTitle(QString("%1 (%2/%3)").arg(imageFiles[index].fileName()).arg(index + 1).arg(imageFiles.size()));
-        QString imagePath = imageFiles[index].absoluteFilePath();
-        if (!image.load(imagePath)) {
-            QApplication::quit();
-            return;
+
+        QElapsedTimer timer;
+        timer.start();
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly)) {
+            return sample;
         }
-        if (image.isNull()) {
-            QApplication::quit();
-            return;
+        QByteArray data = file.readAll();
+        sample.milliseconds[BenchmarkSample::Read] = elapsedMilliseconds(timer);
+
+        timer.restart();
+        QBuffer buffer(&data);
+        buffer.open(QIODevice::ReadOnly);
+        QImageReader reader(&buffer);
+        QImage decoded = reader.read();
+        sample.milliseconds[BenchmarkSample::Decode] = elapsedMilliseconds(timer);
+        if (decoded.isNull()) {
+            return sample;
         }
-        image = image.convertToFormat(QImage::Format_ARGB32);
-        zoomLevel = 1.0f;
-        updateTexture();
-        update();
+        sample.size = decoded.size();
+
+        timer.restart();
+        QImage converted = uploadableImage(decoded);
+        sample.milliseconds[BenchmarkSample::Convert] = elapsedMilliseconds(timer);
+
+        PixelTransfer transfer;
+        if (converted.width() > maxTextureSize || converted.height() > maxTextureSize
+            || !pixelTransfer(converted.format(), redTexturesSupported, &transfer)) {
+            return sample;
+        }
+
+        timer.restart();
+        QOpenGLTexture texture(QOpenGLTexture::Target2D);
+        texture.setSize(converted.width(), converted.height());
+        texture.setFormat(transfer.textureFormat);
+        texture.setMipLevels(texture.maximumMipLevels());
+        texture.allocateStorage();
+        QOpenGLPixelTransferOptions options;
+        options.setAlignment(converted.bytesPerLine() % 4 == 0 ? 4 : 1);
+        options.setRowLength(converted.bytesPerLine() / transfer.bytesPerPixel);
+        texture.setData(0, transfer.format, transfer.type, converted.constBits(), &options);
+        glFinish();
+        sample.milliseconds[BenchmarkSample::Upload] = elapsedMilliseconds(timer);
+
+        timer.restart();
+        texture.generateMipMaps();
+        texture.setMinificationFilter(QOpenGLTexture::LinearMipMapLinear);
+        texture.setMagnificationFilter(QOpenGLTexture::Linear);
+        glFinish();
+        sample.milliseconds[BenchmarkSample::Mipmap] = elapsedMilliseconds(timer);
+
+        timer.restart();
+        paint(&texture);
+        glFinish();
+        sample.milliseconds[BenchmarkSample::Paint] = elapsedMilliseconds(timer);
+        return sample;
     }
 
-    void loadNextImage() {
-        if (currentImageIndex + 1 < imageFiles.size()) {
-            loadImage(currentImageIndex + 1);
+    void run(const QStringList& paths) {
+        for (const QString& path : paths) {
+            samples.append(measure(path));
         }
     }
 
-    void loadPreviousImage() {
-        if (currentImageIndex - 1 >= 0) {
-            loadImage(currentImageIndex - 1);
+    QByteArray csvReport() const {
+        QByteArray output;
+        QTextStream stream(&output);
+        stream << "path,width,height";
+        for (int i = 0; i < BenchmarkSample::StageCount; ++i) {
+            stream << ',' << benchmarkStageNames[i] << "_ms";
+        }
+        stream << '\n';
+        for (const BenchmarkSample& sample : samples) {
+            stream << csvField(sample.path) << ',' << sample.size.width() << ',' << sample.size.height();
+            for (int i = 0; i < BenchmarkSample::StageCount; ++i) {
+                stream << ',' << QString::number(sample.milliseconds[i], 'f', 3);
+            }
+            stream << '\n';
+        }
+        stream << "\nstage,p50_ms,p95_ms,p99_ms\n";
+        for (int i = 0; i < BenchmarkSample::StageCount; ++i) {
+            QVector<double> values = stageValues(static_cast<BenchmarkSample::Stage>(i));
+            stream << benchmarkStageNames[i];
+            for (double rank : { 50.0, 95.0, 99.0 }) {
+                stream << ',' << QString::number(percentile(values, rank), 'f', 3);
+            }
+            stream << '\n';
         }
+        stream.flush();
+        return output;
     }
 
-    void updateTexture() {
-        makeCurrent();
-        if (texture) {
-            texture->destroy();
-            delete texture;
-            texture = nullptr;
+    QByteArray jsonReport() const {
+        QJsonArray images;
+        for (const BenchmarkSample& sample : samples) {
+            QJsonObject image;
+            image["path"] = sample.path;
+            image["width"] = sample.size.width();
+            image["height"] = sample.size.height();
+            for (int i = 0; i < BenchmarkSample::StageCount; ++i) {
+                image[QString(benchmarkStageNames[i]) + "_ms"] = sample.milliseconds[i];
+            }
+            images.append(image);
         }
-        if (!image.isNull()) {
-            texture = new QOpenGLTexture(image);
-            if (texture && texture->isCreated()) {
-                texture->setMinificationFilter(QOpenGLTexture::LinearMipMapLinear);
-                texture->setMagnificationFilter(QOpenGLTexture::Linear);
-                texture->generateMipMaps();
-            } else {
-                delete texture;
-                texture = nullptr;
+        QJsonObject summary;
+        for (int i = 0; i < BenchmarkSample::StageCount; ++i) {
+            QVector<double> values = stageValues(static_cast<BenchmarkSample::Stage>(i));
+            QJsonObject stage;
+            stage["p50_ms"] = percentile(values, 50.0);
+            stage["p95_ms"] = percentile(values, 95.0);
+            stage["p99_ms"] = percentile(values, 99.0);
+            stage["count"] = values.size();
+            summary[benchmarkStageNames[i]] = stage;
+        }
+        QJsonObject root;
+        root["renderer"] = QString::fromLatin1(reinterpret_cast<const char*>(glGetString(GL_RENDERER)));
+        root["images"] = images;
+        root["summary"] = summary;
+        return QJsonDocument(root).toJson();
+    }
+
+private:
+    void paint(QOpenGLTexture* paintTexture) {
+        framebuffer->bind();
+        glViewport(0, 0, framebufferSize.width(), framebufferSize.height());
+        glClear(GL_COLOR_BUFFER_BIT);
+        drawTexture(paintTexture, framebufferSize, false);
+        framebuffer->release();
+    }
+
+    QVector<double> stageValues(BenchmarkSample::Stage stage) const {
+        QVector<double> values;
+        for (const BenchmarkSample& sample : samples) {
+            if (sample.milliseconds[stage] >= 0.0) {
+                values.append(sample.milliseconds[stage]);
             }
         }
-        doneCurrent();
+        return values;
     }
 
-    QImage image;
-    QOpenGLShaderProgram* shaderProgram;
-    QOpenGLTexture* texture;
-    unsigned int VBO, EBO;
-    float zoomLevel;
-    QFileInfoList imageFiles;
-    int currentImageIndex;
+    const QSize framebufferSize = QSize(1920, 1080);
+
+    QOpenGLFramebufferObject* framebuffer;
+    QVector<BenchmarkSample> samples;
 };
 
-class ImageViewer : public QMainWindow {
-    Q_OBJECT
+// Headless --convert: the viewer's decode engine feeding the offscreen quad
+// program, which makes the final Lanczos reduction, and encoders writing the
+// results. Decodes (reading by mapping the file) run on decodePool and
+// encodes on encodePool, each across all cores; rendering is on this
+// thread, which owns the context. At most inFlightLimit images are
+// anywhere between decode and written file, so a slow disk or encoder holds
+// back decoding instead of filling memory.
+class BatchConverter : public QObject, public OffscreenRenderer {
 public:
-    ImageViewer(const QString& path, QWidget* parent = nullptr)
-        : QMainWindow(parent) {
-        setWindowTitle(QFileInfo(path).fileName());
-        resize(800, 600);
+    BatchConverter(const QString& outputDirectory, const QSize& box, const QByteArray& format, int quality)
+        : outputDirectory(outputDirectory), box(box), format(format), quality(quality), framebuffer(nullptr),
+          nextPath(0), decoding(0), encoding(0), converted(0), inFlightLimit(qMax(2, 2 * QThread::idealThreadCount())) {
+        encodePool.setMaxThreadCount(qMax(1, QThread::idealThreadCount()));
+    }
 
-        ImageGLWidget* glWidget = new ImageGLWidget(path, this);
-        setCentralWidget(glWidget);
+    ~BatchConverter() {
+        decodePool.waitForDone();
+        encodePool.waitForDone();
+        if (context.makeCurrent(&surface)) {
+            delete framebuffer;
+            context.doneCurrent();
+        }
     }
 
-    ImageViewer(const QImage& clipboardImage, QWidget* parent = nullptr)
-        : QMainWindow(parent) {
-        setWindowTitle("grxiv");
-        resize(800, 600);
+    // Returns how many of paths were written.
+    int run(const QStringList& inputPaths) {
+        if (!QDir().mkpath(outputDirectory)) {
+            return 0;
+        }
+        paths = inputPaths;
+        fill();
+        if (decoding + encoding > 0) {
+            finished.exec();
+        }
+        return converted;
+    }
 
-        ImageGLWidget* glWidget = new ImageGLWidget(clipboardImage, this);
-        setCentralWidget(glWidget);
+private:
+    void fill() {
+        while (nextPath < paths.size() && decoding + encoding < inFlightLimit) {
+            DecodeRequest request;
+            request.key = paths[nextPath];
+            request.path = paths[nextPath];
+            // Twice the box is as far as the shader reduces well without
+            // mipmaps; JPEG gets most of the way there in the DCT domain.
+            if (box.isValid()) {
+                request.targetSize = box * maxShaderDownscale;
+            }
+            ++nextPath;
+            ++decoding;
+            decodePool.start(new DecodeJob(request, QSharedPointer<QAtomicInt>(new QAtomicInt(0)), this,
+                [this](const DecodeRequest& decodedRequest, const DecodedImage& decoded) { imageDecoded(decodedRequest, decoded); }));
+        }
+        if (decoding + encoding == 0) {
+            finished.quit();
+        }
+    }
+
+    void imageDecoded(const DecodeRequest& request, const DecodedImage& decoded) {
+        --decoding;
+        QImage output = decoded.image.isNull() ? QImage() : render(decoded);
+        if (!output.isNull()) {
+            ++encoding;
+            QString target = QDir(outputDirectory).filePath(QFileInfo(request.path).completeBaseName() + '.' + QString::fromLatin1(format));
+            QByteArray writerFormat = format;
+            int writerQuality = quality;
+            BatchConverter* receiver = this;
+            encodePool.start(new FunctionJob([receiver, output, target, writerFormat, writerQuality]() {
+                QImageWriter writer(target, writerFormat);
+                writer.setQuality(writerQuality);
+                bool written = writer.write(output);
+                QMetaObject::invokeMethod(receiver, [receiver, written]() { receiver->imageEncoded(written); }, Qt::QueuedConnection);
+            }));
+        }
+        fill();
+    }
+
+    void imageEncoded(bool written) {
+        --encoding;
+        if (written) {
+            ++converted;
+        }
+        fill();
+    }
+
+    // Scales decoded to fit the box on the GPU. Images the box does not
+    // shrink are passed through, and images larger than a texture can hold
+    // fall back to a CPU scale.
+    QImage render(const DecodedImage& decoded) {
+        QSize size = decoded.image.size();
+        QSize target = box.isValid() && (size.width() > box.width() || size.height() > box.height())
+            ? size.scaled(box, Qt::KeepAspectRatio).expandedTo(QSize(1, 1)) : size;
+        PixelTransfer transfer;
+        if (target == size || size.width() > maxTextureSize || size.height() > maxTextureSize
+            || !pixelTransfer(decoded.image.format(), redTexturesSupported, &transfer)) {
+            QImage image = decoded.bottomUp ? decoded.image.mirrored() : decoded.image;
+            return target == size ? image : image.scaled(target, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        }
+        if (!framebuffer || framebuffer->size() != target) {
+            delete framebuffer;
+            framebuffer = new QOpenGLFramebufferObject(target);
+        }
+        bool mipmapped = static_cast<qreal>(size.width()) / target.width() > maxShaderDownscale;
+        QOpenGLTexture texture(QOpenGLTexture::Target2D);
+        texture.setSize(size.width(), size.height());
+        texture.setFormat(transfer.textureFormat);
+        texture.setMipLevels(mipmapped ? texture.maximumMipLevels() : 1);
+        texture.allocateStorage();
+        QOpenGLPixelTransferOptions options;
+        options.setAlignment(decoded.image.bytesPerLine() % 4 == 0 ? 4 : 1);
+        options.setRowLength(decoded.image.bytesPerLine() / transfer.bytesPerPixel);
+        texture.setData(0, transfer.format, transfer.type, decoded.image.constBits(), &options);
+        if (mipmapped) {
+            texture.generateMipMaps();
+        }
+        texture.setMinificationFilter(mipmapped ? QOpenGLTexture::LinearMipMapLinear : QOpenGLTexture::Linear);
+        texture.setMagnificationFilter(QOpenGLTexture::Linear);
+        texture.setWrapMode(QOpenGLTexture::ClampToEdge);
+
+        framebuffer->bind();
+        glViewport(0, 0, target.width(), target.height());
+        glClear(GL_COLOR_BUFFER_BIT);
+        drawTexture(&texture, target, decoded.bottomUp);
+        framebuffer->release();
+        // Blending is off, so the framebuffer holds straight alpha.
+        QImage rendered = framebuffer->toImage();
+        if (rendered.format() == QImage::Format_ARGB32_Premultiplied) {
+            rendered.reinterpretAsFormat(QImage::Format_ARGB32);
+        } else if (rendered.format() == QImage::Format_RGBA8888_Premultiplied) {
+            rendered.reinterpretAsFormat(QImage::Format_RGBA8888);
+        }
+        return rendered;
     }
+
+    QString outputDirectory;
+    QSize box;
+    QByteArray format;
+    int quality;
+    QOpenGLFramebufferObject* framebuffer;
+    QStringList paths;
+    int nextPath;
+    int decoding;
+    int encoding;
+    int converted;
+    int inFlightLimit;
+    QEventLoop finished;
+    QThreadPool decodePool;
+    QThreadPool encodePool;
 };
 
 int main(int argc, char* argv[]) {
+    // A plain "grxiv <path>" is first offered to a resident server, which
+    // shows it in an already initialised window within milliseconds.
+    if (argc == 2 && argv[1][0] != '-') {
+        int forwarded = forwardToServer(QString::fromLocal8Bit(argv[1]));
+        if (forwarded >= 0) {
+            return forwarded;
+        }
+    }
+
+    QCoreApplication::setAttribute(Qt::AA_ShareOpenGLContexts);
     QApplication app(argc, argv);
 
     QCommandLineParser parser;
     parser.addHelpOption();
-    parser.addPositionalArgument("path", "Path to image file or directory");
+    parser.addPositionalArgument("path", "Path to image file or directory; several image files are compared side by side", "path...");
+    QCommandLineOption prefetchOption("prefetch", "Number of neighbouring images to decode in the background", "radius", "1");
+    parser.addOption(prefetchOption);
+    QCommandLineOption cacheRamOption("cache-ram", "Memory budget for decoded images (e.g. 2G, 512M)", "size", "1G");
+    parser.addOption(cacheRamOption);
+    QCommandLineOption cacheVramOption("cache-vram", "Memory budget for uploaded textures (e.g. 1G, 256M)", "size", "512M");
+    parser.addOption(cacheVramOption);
+    QCommandLineOption readaheadOption("readahead", "Number of files past the prefetched ones to pull into the page cache", "count", "8");
+    parser.addOption(readaheadOption);
+    QCommandLineOption ioDepthOption("io-depth", "Number of readahead requests kept in flight", "count", "4");
+    parser.addOption(ioDepthOption);
+    QCommandLineOption fullResolutionOption("full-resolution", "Always decode images at full resolution instead of the window size");
+    parser.addOption(fullResolutionOption);
+    QCommandLineOption compressTexturesOption("compress-textures", "Keep window-sized textures as BC1/BC3 blocks, cached on disk with the thumbnails");
+    parser.addOption(compressTexturesOption);
+    QCommandLineOption noThumbnailCacheOption("no-thumbnail-cache", "Do not read or write the persistent thumbnail cache");
+    parser.addOption(noThumbnailCacheOption);
+    QCommandLineOption noMemoryPressureOption("no-memory-pressure", "Keep the cache budgets fixed instead of shrinking them under system memory pressure");
+    parser.addOption(noMemoryPressureOption);
+    QCommandLineOption benchmarkOption("benchmark", "Measure the load/upload/render pipeline offscreen for every image in a directory", "dir");
+    parser.addOption(benchmarkOption);
+    QCommandLineOption benchmarkFormatOption("benchmark-format", "Benchmark report format: csv or json", "format", "csv");
+    parser.addOption(benchmarkFormatOption);
+    QCommandLineOption benchmarkOutputOption("benchmark-output", "Write the benchmark report to a file instead of stdout", "file");
+    parser.addOption(benchmarkOutputOption);
+    QCommandLineOption convertOption("convert", "Write each image given as a path into dir instead of opening a window", "dir");
+    parser.addOption(convertOption);
+    QCommandLineOption resizeOption("resize", "With --convert, scale images down to fit WIDTHxHEIGHT", "size");
+    parser.addOption(resizeOption);
+    QCommandLineOption convertFormatOption("convert-format", "With --convert, the output format (jpg, png, ...)", "format", "jpg");
+    parser.addOption(convertFormatOption);
+    QCommandLineOption qualityOption("quality", "With --convert, the encoder quality from 0 to 100", "quality", "85");
+    parser.addOption(qualityOption);
+    QCommandLineOption pyramidOption("make-pyramid", "Write the image given as path as a Deep Zoom pyramid to file.dzi and file_files/", "file.dzi");
+    parser.addOption(pyramidOption);
+    QCommandLineOption serverOption("server", "Stay resident and show paths passed by later invocations in a warm window");
+    parser.addOption(serverOption);
     parser.process(app);
 
+    ViewerOptions options;
+    bool ok = false;
+    options.prefetchRadius = parser.value(prefetchOption).toInt(&ok);
+    if (!ok || options.prefetchRadius < 0) {
+        parser.showHelp(1);
+    }
+    options.ramCacheBytes = parseByteSize(parser.value(cacheRamOption), &ok);
+    if (!ok) {
+        parser.showHelp(1);
+    }
+    options.vramCacheBytes = parseByteSize(parser.value(cacheVramOption), &ok);
+    if (!ok) {
+        parser.showHelp(1);
+    }
+    options.readaheadCount = parser.value(readaheadOption).toInt(&ok);
+    if (!ok || options.readaheadCount < 0) {
+        parser.showHelp(1);
+    }
+    options.ioDepth = parser.value(ioDepthOption).toInt(&ok);
+    if (!ok || options.ioDepth < 1) {
+        parser.showHelp(1);
+    }
+    options.reducedDecode = !parser.isSet(fullResolutionOption);
+    options.compressTextures = parser.isSet(compressTexturesOption);
+    options.watchMemoryPressure = !parser.isSet(noMemoryPressureOption);
+    if (!parser.isSet(noThumbnailCacheOption)) {
+        options.thumbnailStorePath = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + "/grxiv/thumbnails.pack";
+        options.compressedStorePath = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + "/grxiv/textures.pack";
+    }
+
+    if (parser.isSet(benchmarkOption)) {
+        QString reportFormat = parser.value(benchmarkFormatOption);
+        if (reportFormat != "csv" && reportFormat != "json") {
+            parser.showHelp(1);
+        }
+        QStringList paths = imagePathsIn(parser.value(benchmarkOption));
+        if (paths.isEmpty()) {
+            return 1;
+        }
+
+        PipelineBenchmark benchmark;
+        if (!benchmark.initialize()) {
+            return 1;
+        }
+        benchmark.run(paths);
+        QByteArray report = reportFormat == "json" ? benchmark.jsonReport() : benchmark.csvReport();
+        QFile output;
+        if (parser.isSet(benchmarkOutputOption)) {
+            output.setFileName(parser.value(benchmarkOutputOption));
+            if (!output.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+                return 1;
+            }
+        } else if (!output.open(stdout, QIODevice::WriteOnly)) {
+            return 1;
+        }
+        output.write(report);
+        return 0;
+    }
+
     QStringList args = parser.positionalArguments();
 
+    if (parser.isSet(pyramidOption)) {
+        if (args.size() != 1) {
+            parser.showHelp(1);
+        }
+        QString error;
+        if (!writeDeepZoomPyramid(args[0], parser.value(pyramidOption), &error)) {
+            QTextStream(stderr) << error << '\n';
+            return 1;
+        }
+        return 0;
+    }
+
+    if (parser.isSet(convertOption)) {
+        QSize box;
+        if (parser.isSet(resizeOption)) {
+            box = parseBoxSize(parser.value(resizeOption));
+            if (!box.isValid()) {
+                parser.showHelp(1);
+            }
+        }
+        QByteArray format = parser.value(convertFormatOption).toLower().toLatin1();
+        int quality = parser.value(qualityOption).toInt(&ok);
+        if (!QImageWriter::supportedImageFormats().contains(format) || !ok || quality < 0 || quality > 100) {
+            parser.showHelp(1);
+        }
+        QStringList paths;
+        for (const QString& arg : args) {
+            paths << imagePathsIn(arg);
+        }
+        if (paths.isEmpty()) {
+            return 1;
+        }
+
+        BatchConverter converter(parser.value(convertOption), box, format, quality);
+        if (!converter.initialize()) {
+            return 1;
+        }
+        QElapsedTimer timer;
+        timer.start();
+        int converted = converter.run(paths);
+        QTextStream(stdout) << "converted " << converted << " of " << paths.size() << " images in "
+                            << QString::number(elapsedMilliseconds(timer) / 1000.0, 'f', 2) << " s\n";
+        return converted == paths.size() ? 0 : 1;
+    }
+    if (parser.isSet(resizeOption)) {
+        parser.showHelp(1);
+    }
+
+    QSharedPointer<ViewerSession> session(new ViewerSession(options));
+    ViewerSession* windows = session.data();
+    session->openWindow = [windows](const QString& path, QWidget* from) { openViewerWindow(windows, path, from); };
+
+    if (parser.isSet(serverOption)) {
+        return runServer(app, session, args.isEmpty() ? QString() : args[0]);
+    }
+
     if (args.isEmpty()) {
+        if (isatty(STDIN_FILENO)) {
+            return 1;
+        }
         QByteArray stdinData;
         QFile stdinFile("/dev/stdin");
         if (stdinFile.open(QIODevice::ReadOnly)) {
-            stdinData = stdinFile.readAll();
-            stdinFile.close();
+            // Pipes are read as a stream of images, each shown as it completes.
+            if (stdinFile.isSequential()) {
+                stdinFile.close();
+                ImageViewer viewer(session);
+                viewer.show();
+                return app.exec();
+            }
+            qint64 size = stdinFile.isSequential() ? 0 : stdinFile.size();
+            uchar* mapped = size > 0 && size <= INT_MAX ? stdinFile.map(0, size) : nullptr;
+            if (mapped) {
+                stdinData = QByteArray::fromRawData(reinterpret_cast<const char*>(mapped), static_cast<int>(size));
+            } else {
+                stdinData = stdinFile.readAll();
+                stdinFile.close();
+            }
         }
 
         if (!stdinData.isEmpty()) {
@@ -325,12 +7012,13 @@ int main(int argc, char* argv[]) {
             }
             clipboardImage = reader.read();
             buffer.close();
+            stdinFile.close();
 
             if (clipboardImage.isNull()) {
                 return 1;
             }
 
-            ImageViewer viewer(clipboardImage);
+            ImageViewer viewer(clipboardImage, session);
             viewer.show();
             return app.exec();
         }
@@ -338,7 +7026,10 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    ImageViewer viewer(args[0]);
+    ImageViewer viewer(args[0], session);
+    if (!viewer.isOpen() || (args.size() > 1 && !viewer.compare(args))) {
+        return 1;
+    }
     viewer.show();
     return app.exec();
 }
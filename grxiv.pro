@@ -1,5 +1,29 @@
-QT += core gui widgets opengl
+QT += core gui widgets opengl network
 TARGET = grxiv
 TEMPLATE = app
 SOURCES += grxiv.cpp
 CONFIG += c++11
+
+# TurboJPEG decodes JPEG directly, with scaled decoding, when libjpeg-turbo
+# is installed; "qmake CONFIG+=no_turbojpeg" leaves it to the Qt plugin.
+CONFIG += link_pkgconfig
+!no_turbojpeg:packagesExist(libturbojpeg) {
+    PKGCONFIG += libturbojpeg
+    DEFINES += GRXIV_TURBOJPEG
+}
+
+# Sequential scanline decoders let --make-pyramid cut gigapixel JPEG, PNG
+# and TIFF sources a strip at a time; without them only formats whose Qt
+# plugin decodes a clip rectangle are accepted.
+!no_libjpeg:packagesExist(libjpeg) {
+    PKGCONFIG += libjpeg
+    DEFINES += GRXIV_LIBJPEG
+}
+!no_libpng:packagesExist(libpng) {
+    PKGCONFIG += libpng
+    DEFINES += GRXIV_LIBPNG
+}
+!no_libtiff:packagesExist(libtiff-4) {
+    PKGCONFIG += libtiff-4
+    DEFINES += GRXIV_LIBTIFF
+}